@@ -2,6 +2,20 @@
 #define AVRGPIO_H
 
 #include <avr/io.h>
+#include <avr/interrupt.h>
+
+// port pins as types
+//
+// A pin is GPIO<port, bit>: it holds no state, everything is known at
+// compile time, so set() and clear() compile to one sbi/cbi and read() to
+// sbic/sbis (the ports B, C and D are all in the low I/O space). The
+// direction is set once with output() or input(), nothing switches it
+// behind the caller's back.
+//
+// OpenDrain<port, bit> drives the line low or lets it go, with the
+// internal pull-up if asked for. PortBits<port, mask> writes several pins
+// of a port at once with interrupts off, so an interrupt handler that
+// changes other pins of the same port in between loses nothing.
 
 namespace avr {
 enum {
@@ -10,56 +24,99 @@ enum {
 	D,
 };
 
-template <int PORT, int PIN> class GPIO {
-public:
-private:
-	const uint8_t bit = 1 << PIN;
-	bool pullup_ = false;
-	void setdir(bool output)
+template <int PORT> struct Port;
+
+template <> struct Port<B> {
+	static volatile uint8_t &in() { return PINB; }
+	static volatile uint8_t &dir() { return DDRB; }
+	static volatile uint8_t &out() { return PORTB; }
+};
+
+template <> struct Port<C> {
+	static volatile uint8_t &in() { return PINC; }
+	static volatile uint8_t &dir() { return DDRC; }
+	static volatile uint8_t &out() { return PORTC; }
+};
+
+template <> struct Port<D> {
+	static volatile uint8_t &in() { return PIND; }
+	static volatile uint8_t &dir() { return DDRD; }
+	static volatile uint8_t &out() { return PORTD; }
+};
+
+template <int PORT, int PIN> struct GPIO {
+	static_assert(PIN >= 0 && PIN < 8, "no such pin");
+	typedef Port<PORT> P;
+	static constexpr uint8_t bit = 1 << PIN;
+
+	static void output() { P::dir() |= bit; }
+	static void input() { P::dir() &= ~bit; }
+	static void set() { P::out() |= bit; }
+	static void clear() { P::out() &= ~bit; }
+	static void write(bool b)
 	{
-		switch (PORT) {
-		case avr::B: if (output) { DDRB |= bit; } else { DDRB &= ~bit; } return;
-		case avr::C: if (output) { DDRC |= bit; } else { DDRC &= ~bit; } return;
-		case avr::D: if (output) { DDRD |= bit; } else { DDRD &= ~bit; } return;
+		if (b) {
+			set();
+		} else {
+			clear();
 		}
 	}
-public:
-	GPIO()
+	static bool read() { return P::in() & bit; }
+	static bool driven() { return P::out() & bit; }	// last written
+};
+
+template <int PORT, int PIN, bool PULLUP = false> struct OpenDrain {
+	typedef GPIO<PORT, PIN> G;
+
+	// the output latch goes low before the pin turns output and the
+	// pin turns input before the pull-up goes on, the line is never
+	// driven high
+	static void low()
 	{
-		setdir(false);
-		setpullup(false);
+		G::clear();
+		G::output();
 	}
-	void setpullup(bool pullup)
+	static void release()
 	{
-		pullup_ = pullup;
-		switch (PORT) {
-		case avr::B: write(pullup_); return;
-		case avr::C: write(pullup_); return;
-		case avr::D: write(pullup_); return;
-		}
+		G::input();
+		if (PULLUP) G::set();
 	}
-	bool read()
+	static void write(bool b)
 	{
-		setdir(false);
-		switch (PORT) {
-		case avr::B: return (PINB & bit) ? 1 : 0;
-		case avr::C: return (PINC & bit) ? 1 : 0;
-		case avr::D: return (PIND & bit) ? 1 : 0;
+		if (b) {
+			release();
+		} else {
+			low();
 		}
 	}
-	void write(bool b)
+	static bool read() { return G::read(); }
+};
+
+template <int PORT, uint8_t MASK> struct PortBits {
+	typedef Port<PORT> P;
+
+	static void write(uint8_t value)
 	{
-		if (pullup_ && b) {
-			setdir(false);
-		} else {
-			setdir(true);
-		}
-		switch (PORT) {
-		case avr::B: if (b) { PORTB |= bit; } else { PORTB &= ~bit; } return;
-		case avr::C: if (b) { PORTC |= bit; } else { PORTC &= ~bit; } return;
-		case avr::D: if (b) { PORTD |= bit; } else { PORTD &= ~bit; } return;
-		}
+		uint8_t sreg = SREG;
+		cli();
+		P::out() = (P::out() & ~MASK) | (value & MASK);
+		SREG = sreg;
+	}
+	static void output()
+	{
+		uint8_t sreg = SREG;
+		cli();
+		P::dir() |= MASK;
+		SREG = sreg;
+	}
+	static void input()
+	{
+		uint8_t sreg = SREG;
+		cli();
+		P::dir() &= ~MASK;
+		SREG = sreg;
 	}
+	static uint8_t read() { return P::in() & MASK; }
 };
 
 } // namespace avr
@@ -0,0 +1,153 @@
+
+#include "cdc.h"
+#include "usb.h"
+
+// The TX ring hands out contiguous spans: usb_tx_reserve() returns room
+// for a whole record and usb_tx_commit() publishes the bytes written.
+// When the room left before the end of the array is too short, the record
+// starts over at index 0 and the end of the array is skipped (a bip
+// buffer), so records are never split and usb_poll_tx() sends straight
+// out of the array.
+
+#define TX_RING_SIZE 128
+
+uint8_t data_tx_buffer[TX_RING_SIZE];
+uint8_t data_tx_buffer_i;	// first byte not sent yet
+uint8_t data_tx_buffer_t;	// where the next record goes
+uint8_t data_tx_buffer_w;	// end of the data before the wrap
+uint8_t data_tx_buffer_n;	// bytes waiting, wrapped when t <= i
+static uint8_t data_tx_reserved;	// start of the span handed out
+uint16_t data_tx_dropped;
+
+uint8_t data_rx_buffer[256];
+int data_rx_buffer_i;
+int data_rx_buffer_n;
+
+extern "C" void clear_buffers()
+{
+	data_tx_buffer_i = 0;
+	data_tx_buffer_t = 0;
+	data_tx_buffer_n = 0;
+	data_rx_buffer_i = 0;
+	data_rx_buffer_n = 0;
+}
+
+void usb_poll_tx()
+{
+	while (data_tx_buffer_n > 0 && usb_data_tx_ready()) {
+		bool wrapped = data_tx_buffer_t <= data_tx_buffer_i;
+		uint8_t n = (wrapped ? data_tx_buffer_w : data_tx_buffer_t) - data_tx_buffer_i;
+		n = n < TX_EP_SIZE ? n : TX_EP_SIZE;
+		if (usb_data_tx(data_tx_buffer + data_tx_buffer_i, n) == 0) break; // keep the bytes until a bank is free
+		data_tx_buffer_i += n;
+		data_tx_buffer_n -= n;
+		if (wrapped && data_tx_buffer_i == data_tx_buffer_w) {
+			data_tx_buffer_i = 0;
+		}
+	}
+}
+
+// room for len contiguous bytes, nullptr if the ring stays full after
+// one poll
+uint8_t *usb_tx_reserve(uint8_t len)
+{
+	for (uint8_t k = 0; k < 2; k++) {
+		if (data_tx_buffer_n == 0) {
+			data_tx_buffer_i = 0;
+			data_tx_buffer_t = 0;
+		}
+		uint8_t i = data_tx_buffer_i;
+		uint8_t t = data_tx_buffer_t;
+		if (data_tx_buffer_n == 0 || t > i) {
+			if (TX_RING_SIZE - t >= len) {
+				data_tx_reserved = t;
+				return data_tx_buffer + t;
+			}
+			if (i >= len) {
+				data_tx_reserved = 0;	// wrap, skip the end of the array
+				return data_tx_buffer;
+			}
+		} else if (i - t >= len) {
+			data_tx_reserved = t;
+			return data_tx_buffer + t;
+		}
+		if (k == 0) usb_poll();
+	}
+	return nullptr;
+}
+
+bool usb_tx_idle()
+{
+	return data_tx_buffer_n == 0;
+}
+
+// publish len bytes written to the span from usb_tx_reserve()
+void usb_tx_commit(uint8_t len)
+{
+	if (data_tx_reserved != data_tx_buffer_t) {
+		data_tx_buffer_w = data_tx_buffer_t;
+		data_tx_buffer_t = 0;
+	}
+	data_tx_buffer_t += len;
+	data_tx_buffer_n += len;
+	if (data_tx_buffer_t == TX_RING_SIZE) {
+		data_tx_buffer_w = TX_RING_SIZE;
+		data_tx_buffer_t = 0;
+	}
+	if (data_tx_buffer_n >= TX_EP_SIZE - 1) {
+		usb_poll_tx();
+	}
+}
+
+static void usb_poll_rx()
+{
+	int space = sizeof(data_rx_buffer) - 1 - data_rx_buffer_n;
+	while (space > 0) {
+		uint8_t tmp[16];
+		int n = sizeof(tmp);
+		n = usb_data_rx(tmp, n < space ? n : space);
+		if (n == 0) break;
+		for (uint8_t i = 0; i < n; i++) {
+			int j = (data_rx_buffer_i + data_rx_buffer_n) % sizeof(data_rx_buffer);
+			data_rx_buffer[j] = tmp[i];
+			data_rx_buffer_n++;
+		}
+		space -= n;
+	}
+}
+
+void usb_poll()
+{
+	usb_poll_tx();
+	usb_poll_rx();
+}
+
+int usb_read_available()
+{
+	return data_rx_buffer_n + usb_read_available_();
+}
+
+uint8_t usb_read_byte()
+{
+	for (int i = 0; i < 2; i++) {
+		if (data_rx_buffer_n > 0) {
+			uint8_t c = data_rx_buffer[data_rx_buffer_i];
+			data_rx_buffer_i = (data_rx_buffer_i + 1) % sizeof(data_rx_buffer);
+			data_rx_buffer_n--;
+			return c;
+		}
+		usb_poll_rx();
+	}
+	return 0;
+}
+
+void usb_write_byte(char c)
+{
+	uint8_t *p = usb_tx_reserve(1);
+	if (!p) {
+		data_tx_dropped++; // nobody reads the port, do not stall the relay
+		return;
+	}
+	*p = c;
+	usb_tx_commit(1);
+}
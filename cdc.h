@@ -0,0 +1,20 @@
+#ifndef CDC_H
+#define CDC_H
+
+#include <stdint.h>
+
+// buffered CDC byte stream on top of the bulk endpoints
+
+extern "C" void clear_buffers();
+void usb_poll_tx();
+bool usb_tx_idle();	// the IN ring is empty
+void usb_poll();
+int usb_read_available();
+uint8_t usb_read_byte();
+void usb_write_byte(char c);
+uint8_t *usb_tx_reserve(uint8_t len);
+void usb_tx_commit(uint8_t len);
+
+extern uint16_t data_tx_dropped; // bytes lost while the IN endpoint was full
+
+#endif
@@ -0,0 +1,166 @@
+#include "generator.h"
+
+#ifdef GENERATOR_ENABLED
+
+#include "hal.h"
+#include "ps2if.h"
+#include "report.h"
+
+Generator generator;
+
+// letters and digits, scan code set 2
+static const uint8_t rollover_keys[] PROGMEM = {
+	0x1c, 0x32, 0x21, 0x23, 0x24, 0x2b, 0x34, 0x33, 0x43, 0x3b, 0x42, 0x4b,
+	0x3a, 0x31, 0x44, 0x4d, 0x15, 0x2d, 0x1b, 0x2c, 0x3c, 0x2a, 0x1d, 0x22,
+	0x35, 0x1a, 0x16, 0x1e, 0x26, 0x25, 0x2e, 0x36, 0x3d, 0x3e, 0x46, 0x45,
+};
+
+#define ROLLOVER_KEYS sizeof(rollover_keys)
+
+static void generator_window(Generator *g)
+{
+	PS2IF *host = &ps2h;
+	g->ms = 0;
+	g->sent = host->sent;
+	g->inhibits = host->inhibits;
+	g->acks = 0;
+	g->resends = 0;
+}
+
+// G <ms> <bytes> ack <n> resend <n> inhibit <n>
+static void generator_report(Generator *g)
+{
+	PS2IF *host = &ps2h;
+	print("G ");
+	print_dec(g->ms);
+	print(" ");
+	print_dec((uint16_t)(host->sent - g->sent));
+	print(" ack ");
+	print_dec(g->acks);
+	print(" resend ");
+	print_dec(g->resends);
+	print(" inhibit ");
+	print_dec((uint16_t)(host->inhibits - g->inhibits));
+	print_crlf();
+	generator_window(g);
+}
+
+void generator_start(Generator *g, uint8_t mode)
+{
+	if (g->mode != GENERATOR_OFF) {
+		generator_stop(g);
+	}
+	g->mode = mode;
+	g->enabled = 1;
+	g->step = 0;
+	g->due = micros();
+	generator_window(g);
+	ps2h.clock_low = PS2_CLOCK_LOW_MIN;
+}
+
+void generator_stop(Generator *g)
+{
+	if (g->mode == GENERATOR_OFF) return;
+	generator_report(g);
+	g->mode = GENERATOR_OFF;
+	ps2h.clock_low = PS2_CLOCK_LOW;
+}
+
+bool generator_host_byte(Generator *g, uint8_t c)
+{
+	if (g->mode == GENERATOR_OFF) return false;
+	PS2IF *host = &ps2h;
+	bool mouse = g->mode == GENERATOR_MOUSE;
+
+	if (c == 0xfe) {
+		g->resends++;
+		pc_resend(host);
+		return true;
+	}
+	if (c == 0xee && !mouse) {
+		pc_put(host, 0xee);	// echo, not acknowledged
+		return true;
+	}
+	pc_put(host, 0xfa);
+	g->acks++;
+	switch (c) {
+	case 0xff:
+		pc_put(host, 0xaa);
+		if (mouse) pc_put(host, 0x00);
+		g->enabled = 1;
+		g->step = 0;
+		break;
+	case 0xf2:
+		if (mouse) {
+			pc_put(host, 0x00);
+		} else {
+			pc_put(host, 0xab);
+			pc_put(host, 0x83);
+		}
+		break;
+	case 0xf4:
+		g->enabled = 1;
+		break;
+	case 0xf5:
+		g->enabled = 0;
+		break;
+	}
+	return true;
+}
+
+static void generator_mouse(Generator *g, PS2IF *host)
+{
+	static const int8_t delta[4][2] = { { 4, 0 }, { 0, -4 }, { -4, 0 }, { 0, 4 } };
+
+	uint32_t now = micros();
+	if ((int32_t)(now - g->due) < 0) return;
+	if (now - g->due >= GENERATOR_MOUSE_INTERVAL) {
+		g->due = now;	// held off by the PC, skip the missed packets
+	}
+	g->due += GENERATOR_MOUSE_INTERVAL;
+	if (queue_room(&host->output_queue) < 3) return;
+
+	int8_t const *d = delta[(g->step >> 5) & 3];	// a square, 32 packets a side
+	uint8_t b = 0x08;
+	if (d[0] < 0) b |= 0x10;
+	if (d[1] < 0) b |= 0x20;
+	pc_put(host, b);
+	pc_put(host, d[0]);
+	pc_put(host, d[1]);
+	g->step++;
+}
+
+void generator_poll(Generator *g, bool timer_event_flag)
+{
+	if (g->mode == GENERATOR_OFF) return;
+	if (timer_event_flag && ++g->ms >= GENERATOR_PERIOD) {
+		generator_report(g);
+	}
+	if (!g->enabled) return;
+
+	// keep two bytes ahead of pc_send(), so responses wait at most that long
+	PS2IF *host = &ps2h;
+	switch (g->mode) {
+	case GENERATOR_TYPEMATIC:
+		while (host->output_queue.len < 2) {
+			pc_put(host, 0x1c);
+		}
+		break;
+	case GENERATOR_ROLLOVER:
+		while (host->output_queue.len < 2) {
+			uint8_t i = g->step;
+			if (i >= ROLLOVER_KEYS) {
+				i -= ROLLOVER_KEYS;
+				pc_put(host, 0xf0);
+			}
+			pc_put(host, pgm_read_byte(rollover_keys + i));
+			if (++g->step == 2 * ROLLOVER_KEYS) g->step = 0;
+		}
+		break;
+	case GENERATOR_MOUSE:
+		generator_mouse(g, host);
+		break;
+	}
+}
+
+#endif // GENERATOR_ENABLED
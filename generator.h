@@ -0,0 +1,60 @@
+#ifndef GENERATOR_H
+#define GENERATOR_H
+
+#include <stdint.h>
+
+//#define GENERATOR_ENABLED
+
+#ifdef GENERATOR_ENABLED
+
+// synthetic load toward the PC port, for stressing PS/2 host controllers
+//
+// Acts as the device itself: the keyboard relay is cut, bytes from the PC
+// are answered here (FA, BAT and ID replies, EE echo, FE resend) and the
+// pattern is clocked out back to back at PS2_CLOCK_LOW_MIN, the fastest
+// legal clock. Patterns:
+//
+//  GENERATOR_TYPEMATIC   the make code of A, repeated without a gap
+//  GENERATOR_ROLLOVER    36 keys pressed in turn, then released in turn
+//  GENERATOR_MOUSE       3 byte movement packets at 200 Hz
+//
+// F5 (disable) holds the pattern until F4 (enable), F4 is implied by a
+// reset. Every GENERATOR_PERIOD ms, and once more on stop, reports
+//
+//  G <ms> <bytes> ack <n> resend <n> inhibit <n>
+//
+// for the window: bytes clocked out, ACKs given to PC commands, resend
+// requests from the PC, and transmissions the PC held off or cut short.
+
+enum {
+	GENERATOR_OFF = 0,
+	GENERATOR_TYPEMATIC,
+	GENERATOR_ROLLOVER,
+	GENERATOR_MOUSE,
+};
+
+#define GENERATOR_PERIOD	1000	// ms
+#define GENERATOR_MOUSE_INTERVAL	5000	// us, 200 Hz
+
+struct Generator {
+	uint8_t mode;
+	uint8_t enabled;	// F4/F5 from the PC
+	uint8_t step;		// position in the pattern
+	uint32_t due;		// us, next mouse packet
+	uint16_t ms;		// in the current window
+	uint16_t sent;		// host counters at the start of the window
+	uint16_t inhibits;
+	uint16_t acks;
+	uint16_t resends;
+};
+
+extern Generator generator;
+
+void generator_start(Generator *g, uint8_t mode);
+void generator_stop(Generator *g);
+bool generator_host_byte(Generator *g, uint8_t c);	// true: answered here
+void generator_poll(Generator *g, bool timer_event_flag);
+
+#endif // GENERATOR_ENABLED
+
+#endif // GENERATOR_H
@@ -0,0 +1,114 @@
+#ifndef HAL_H
+#define HAL_H
+
+#include <stdint.h>
+#include "profile.h"
+
+// hardware abstraction for the protocol code
+//
+// The PS/2 lines are reached through the functions in ps2if.h, the CDC
+// byte sink through usb.h. This header covers interrupt control, the
+// microsecond clock, EEPROM reads and the AVR specific keywords. Building
+// without __AVR__ selects the simulated backend in host/.
+
+#ifdef __AVR__
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include <avr/sleep.h>
+
+static inline void hal_irq_disable()
+{
+	cli();
+#ifdef PROFILE_ENABLED
+	profile_irq_off();
+#endif
+}
+
+static inline void hal_irq_enable()
+{
+#ifdef PROFILE_ENABLED
+	profile_irq_on();
+#endif
+	sei();
+}
+
+static inline uint8_t hal_irq_save()
+{
+	uint8_t sreg = SREG;
+	cli();
+#ifdef PROFILE_ENABLED
+	profile_irq_off();
+#endif
+	return sreg;
+}
+
+static inline void hal_irq_restore(uint8_t sreg)
+{
+#ifdef PROFILE_ENABLED
+	if (sreg & 0x80) profile_irq_on();
+#endif
+	SREG = sreg;
+}
+
+// idle sleep until the next interrupt has run, entered with interrupts
+// disabled: sei() takes effect after the next instruction, so an
+// interrupt after the caller's last check still wakes the sleep. The
+// CPU wakes within 4 cycles in idle mode, Timer0 at the latest after
+// 128 us.
+static inline void hal_sleep()
+{
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	sleep_enable();
+#ifdef PROFILE_ENABLED
+	profile_irq_on();
+#endif
+	sei();
+	sleep_cpu();
+	sleep_disable();
+}
+
+// place where the simulator may let interrupts preempt the main loop
+static inline void hal_preempt_point()
+{
+}
+
+// one-shot timeout on the Timer1 compare A interrupt (TIMER1_COMPA_vect)
+//
+// Timer1 runs free at the CPU clock, so a single timeout is at most
+// 4000 us. Arming again moves the deadline and drops a pending match.
+static inline void hal_timeout_init()
+{
+	TCCR1A = 0;
+	TCCR1B = 1 << CS10;	// clk/1
+}
+
+static inline void hal_timeout_arm(uint16_t us)
+{
+	OCR1A = TCNT1 + us * (uint16_t)(F_CPU / 1000000);
+	TIFR1 = 1 << OCF1A;
+	TIMSK1 |= 1 << OCIE1A;
+}
+
+static inline void hal_timeout_cancel()
+{
+	TIMSK1 &= ~(1 << OCIE1A);
+}
+
+// free running Timer1, CPU cycles (62.5 ns), for timing short intervals
+static inline uint16_t hal_cycles()
+{
+	return TCNT1;
+}
+
+#else
+
+#include "host/hal_host.h"
+
+#endif
+
+uint32_t micros();
+
+#endif // HAL_H
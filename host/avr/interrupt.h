@@ -0,0 +1,13 @@
+#ifndef MOCK_AVR_INTERRUPT_H
+#define MOCK_AVR_INTERRUPT_H
+
+#include "usb_mock.h"
+
+#define cli() usb_mock_cli()
+#define sei() usb_mock_sei()
+
+#ifndef ISR
+#define ISR(vector, ...) extern "C" void vector(void)
+#endif
+
+#endif // MOCK_AVR_INTERRUPT_H
@@ -0,0 +1,81 @@
+#ifndef MOCK_AVR_IO_H
+#define MOCK_AVR_IO_H
+
+#include "usb_mock.h"
+
+// USB registers of the ATmega32U2 backed by host/usb_mock.cpp
+
+#ifndef __AVR_ATmega32U2__
+#define __AVR_ATmega32U2__
+#endif
+
+extern MockReg UENUM;
+extern MockReg UEINTX;
+extern MockReg UEDATX;
+extern MockReg UEBCLX;
+extern MockReg UECONX;
+extern MockReg UECFG0X;
+extern MockReg UECFG1X;
+extern MockReg UEIENX;
+extern MockReg UERST;
+extern MockReg UDINT;
+extern MockReg UDIEN;
+extern MockReg UDCON;
+extern MockReg UDADDR;
+extern MockReg UDFNUML;
+extern MockReg USBCON;
+extern MockReg PLLCSR;
+extern MockReg REGCR;
+extern MockReg SREG;
+
+// UEINTX
+#define FIFOCON 7
+#define NAKINI 6
+#define RWAL 5
+#define NAKOUTI 4
+#define RXSTPI 3
+#define RXOUTI 2
+#define STALLEDI 1
+#define TXINI 0
+
+// UEIENX
+#define FLERRE 7
+#define NAKINE 6
+#define NAKOUTE 4
+#define RXSTPE 3
+#define RXOUTE 2
+#define STALLEDE 1
+#define TXINE 0
+
+// UECONX
+#define STALLRQ 5
+#define STALLRQC 4
+#define RSTDT 3
+#define EPEN 0
+
+// UDINT / UDIEN
+#define UPRSMI 6
+#define EORSMI 5
+#define WAKEUPI 4
+#define EORSTI 3
+#define SOFI 2
+#define SUSPI 0
+#define UPRSME 6
+#define EORSME 5
+#define WAKEUPE 4
+#define EORSTE 3
+#define SOFE 2
+#define SUSPE 0
+
+// UDADDR
+#define ADDEN 7
+
+// USBCON
+#define USBE 7
+#define FRZCLK 5
+
+// PLLCSR
+#define PLLE 1
+#define PLOCK 0
+
+#endif // MOCK_AVR_IO_H
@@ -0,0 +1,13 @@
+#ifndef MOCK_AVR_PGMSPACE_H
+#define MOCK_AVR_PGMSPACE_H
+
+#include <stdint.h>
+
+#ifndef PROGMEM
+#define PROGMEM
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+#endif
+#define pgm_read_ptr(p) (*(void *const *)(p))
+
+#endif // MOCK_AVR_PGMSPACE_H
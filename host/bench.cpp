@@ -0,0 +1,238 @@
+
+// native microbenchmark of the firmware hot paths
+//
+// Times countbits(), queue_put()/queue_get(), intr() over whole frames,
+// print_hex(), a whole log line and usb_write_byte() on the host backend. Host numbers only
+// compare the functions with each other and across changes of the code;
+// cycle counts on the AVR come from 'make cycles' (tools/avrcycles.py).
+//
+//  ps2sniffer-bench [-n iterations] [-b baseline] [-w baseline]
+//
+// -w writes every time in units of a fixed reference loop timed in the
+// same run, which takes out most of the speed of the machine. -b compares
+// against such a file and names every function more than BENCH_TOLERANCE
+// percent slower. Host times are noisy and say nothing about the AVR, so
+// this only informs; the gate on ISR cost is 'make cycles'. 'make bench'
+// compares against tools/bench.baseline, 'make bench-baseline' rewrites it.
+
+#include "cdc.h"
+#include "hal.h"
+#include "ps2if.h"
+#include "queue.h"
+#include "report.h"
+#include "sim.h"
+#include "usb.h"
+#include "usb_host.h"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+uint8_t countbits(uint16_t c);
+void intr(PS2IF *dev);
+void keyboard_setup();
+extern PS2IF ps2d;
+
+#define BENCH_TOLERANCE 25	// percent
+
+static volatile unsigned sink;
+
+// best of five runs, nanoseconds per call
+template <typename F> static double measure(unsigned long n, F fn)
+{
+	double best = 0;
+	for (int run = 0; run < 5; run++) {
+		auto t0 = std::chrono::steady_clock::now();
+		fn(n);
+		auto t1 = std::chrono::steady_clock::now();
+		double ns = std::chrono::duration<double, std::nano>(t1 - t0).count() / n;
+		if (run == 0 || ns < best) best = ns;
+	}
+	return best;
+}
+
+// not firmware code, the unit of the baseline
+static void bench_reference(unsigned long n)
+{
+	unsigned s = 0;
+	for (unsigned long i = 0; i < n; i++) {
+		s = s * 33 + (i >> 3);
+		sink = s;
+	}
+}
+
+static void bench_countbits(unsigned long n)
+{
+	unsigned s = 0;
+	for (unsigned long i = 0; i < n; i++) {
+		s += countbits(i);
+	}
+	sink = s;
+}
+
+static Queue queue;
+
+static void bench_queue_put(unsigned long n)
+{
+	for (unsigned long i = 0; i < n; i++) {
+		if ((i & 15) == 0) queue_clear(&queue);
+		queue_put(&queue, i);
+	}
+}
+
+// includes the refill, 16 queue_put() calls for 16 queue_get() calls
+static void bench_queue_get(unsigned long n)
+{
+	unsigned s = 0;
+	for (unsigned long i = 0; i < n; i++) {
+		if ((i & 15) == 0) {
+			for (uint8_t j = 0; j < 16; j++) {
+				queue_put(&queue, j);
+			}
+		}
+		s += queue_get(&queue);
+	}
+	sink = s;
+}
+
+static uint16_t frames[4];
+
+// start bit, data, odd parity and stop bit as shifted out by a keyboard
+static uint16_t frame(uint8_t c)
+{
+	uint16_t d = c;
+	if (!(countbits(d) & 1)) d |= 0x100;
+	return (d | 0x200) << 1;
+}
+
+// one call per falling clock edge of a received frame, start bit to stop bit
+static void bench_intr(unsigned long n)
+{
+	for (unsigned long i = 0; i < n; i++) {
+		uint16_t bits = frames[(i / 11) & 3] >> (i % 11);
+		sim_drive(SIM_KB_DATA, SIM_PEER, !(bits & 1));
+		intr(&ps2d);
+		if (i % 11 == 10) queue_clear(&ps2d.input_queue);
+	}
+}
+
+static void bench_print_hex(unsigned long n)
+{
+	for (unsigned long i = 0; i < n; i++) {
+		print_hex(i);
+		if ((i & 7) == 7) print_crlf();
+		if ((i & 0xfff) == 0) usb_host_output.clear();
+	}
+}
+
+// the line report_device_to_host() writes for every byte
+static void bench_log_line(unsigned long n)
+{
+	for (unsigned long i = 0; i < n; i++) {
+		print("H    <- ");
+		print_hex(i);
+		print(" D");
+		print_crlf();
+		if ((i & 0xff) == 0) usb_host_output.clear();
+	}
+}
+
+static void bench_usb_write_byte(unsigned long n)
+{
+	for (unsigned long i = 0; i < n; i++) {
+		usb_write_byte('0' + (i & 15));
+		if ((i & 0xfff) == 0) usb_host_output.clear();
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long n = 1000000;
+	char const *compare = nullptr;
+	char const *write = nullptr;
+	int c;
+	while ((c = getopt(argc, argv, "n:b:w:")) != -1) {
+		switch (c) {
+		case 'n': n = strtoul(optarg, nullptr, 0); break;
+		case 'b': compare = optarg; break;
+		case 'w': write = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-n iterations] [-b baseline] [-w baseline]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	sim_reset();
+	usb_init();
+	keyboard_setup();
+	report_init();
+	queue_init(&queue, 2, 16);
+	// the keyboard holds the clock low, every intr() call sees a falling edge
+	hal_irq_disable();
+	sim_drive(SIM_KB_CLOCK, SIM_PEER, true);
+	static const uint8_t bytes[] = { 0x1c, 0xf0, 0xe0, 0xaa };
+	for (int i = 0; i < 4; i++) {
+		frames[i] = frame(bytes[i]);
+		for (int b = 0; b < 11; b++) {
+			sim_drive(SIM_KB_DATA, SIM_PEER, !((frames[i] >> b) & 1));
+			intr(&ps2d);
+		}
+		if (queue_get(&ps2d.input_queue) != bytes[i]) {
+			fprintf(stderr, "intr() did not receive %02x\n", bytes[i]);
+			return 1;
+		}
+	}
+
+	struct {
+		char const *name;
+		double ns;
+	} results[] = {
+		{ "countbits", measure(n, bench_countbits) },
+		{ "queue_put", measure(n, bench_queue_put) },
+		{ "queue_get", measure(n, bench_queue_get) },
+		{ "intr", measure(n, bench_intr) },
+		{ "print_hex", measure(n, bench_print_hex) },
+		{ "log line", measure(n, bench_log_line) },
+		{ "usb_write_byte", measure(n, bench_usb_write_byte) },
+	};
+
+	double ref = results[1].ns;
+	double unit = measure(n, bench_reference);
+	printf("%-16s %9s %9s\n", "function", "ns/call", "x queue_put");
+	for (auto const &r : results) {
+		printf("%-16s %9.2f %9.2f\n", r.name, r.ns, r.ns / ref);
+	}
+
+	if (write) {
+		FILE *f = fopen(write, "w");
+		if (!f) {
+			perror(write);
+			return 2;
+		}
+		for (auto const &r : results) {
+			fprintf(f, "%.3f %s\n", r.ns / unit, r.name);
+		}
+		fclose(f);
+	}
+	if (compare) {
+		FILE *f = fopen(compare, "r");
+		if (!f) {
+			perror(compare);
+			return 2;
+		}
+		double base;
+		char name[32];
+		while (fscanf(f, "%lf %31[^\n]", &base, name) == 2) {
+			for (auto const &r : results) {
+				if (strcmp(r.name, name) != 0) continue;
+				double now = r.ns / unit;
+				if (now > base * (100 + BENCH_TOLERANCE) / 100) {
+					printf("%s: %.3f reference loops, baseline %.3f\n", name, now, base);
+				}
+			}
+		}
+		fclose(f);
+	}
+	return 0;
+}
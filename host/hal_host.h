@@ -0,0 +1,31 @@
+#ifndef HAL_HOST_H
+#define HAL_HOST_H
+
+#include <stdint.h>
+
+// simulated backend for building the protocol code on a Linux host
+
+#define PROGMEM
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+
+// interrupt handlers become plain functions called by the simulator
+#define ISR(vector, ...) extern "C" void vector(void)
+
+void hal_irq_disable();
+void hal_irq_enable();
+uint8_t hal_irq_save();
+void hal_irq_restore(uint8_t state);
+void hal_preempt_point();
+void hal_sleep();	// until an interrupt, or the next 128 us Timer0 overflow
+
+// 1 KB of simulated EEPROM, erased (0xff) by sim_reset()
+uint8_t eeprom_read_byte(const uint8_t *addr);
+
+// the compare match becomes TIMER1_COMPA_vect at virtual time now + us
+void hal_timeout_init();
+void hal_timeout_arm(uint16_t us);
+void hal_timeout_cancel();
+uint16_t hal_cycles();	// virtual time at 16 MHz
+
+#endif // HAL_HOST_H
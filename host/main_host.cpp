@@ -0,0 +1,484 @@
+
+// native smoke check of the relay: an emulated keyboard and PC exchange
+// bytes through the firmware's protocol code on simulated buses
+
+#include "cdc.h"
+#include "generator.h"
+#include "hal.h"
+#include "models.h"
+#include "mouse.h"
+#include "ps2if.h"
+#include "queue.h"
+#include "remap.h"
+#include "replay.h"
+#include "report.h"
+#include "sched.h"
+#include "shadow.h"
+#include "sim.h"
+#include "timing.h"
+#include "usb.h"
+#include "usb_host.h"
+#include <functional>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void keyboard_setup();
+void ps2_loop();
+bool ps2_idle();
+
+static SimKeyboard kb;
+static SimPC pc;
+static int failures = 0;
+
+static void step()
+{
+	usb_poll();
+	command_poll();
+	report_poll();
+	ps2_loop();
+	sim_advance(10);
+}
+
+static bool run_until(std::function<bool()> done, uint32_t limit_us)
+{
+	uint64_t end = sim_now() + limit_us;
+	while (sim_now() < end) {
+		if (done()) return true;
+		step();
+	}
+	return done();
+}
+
+static void check(bool ok, char const *what)
+{
+	printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+	if (!ok) failures++;
+}
+
+static std::string order;	// of the scheduled test tasks
+
+static bool same(std::vector<uint8_t> const &v, std::vector<uint8_t> const &expected)
+{
+	return v == expected;
+}
+
+int main()
+{
+	sim_reset();
+	kb.attach();
+	pc.attach();
+	usb_init();
+	keyboard_setup();
+	report_init();
+	hal_irq_enable();
+
+	kb.send(0x1c);
+	kb.send(0xf0);
+	kb.send(0x1c);
+	run_until([]() { return pc.received.size() >= 3; }, 100000);
+	check(same(pc.received, { 0x1c, 0xf0, 0x1c }), "keyboard to PC");
+
+	pc.received.clear();
+	pc.send(0xed);
+	run_until([]() { return pc.received.size() >= 1; }, 100000);
+	pc.send(0x02);
+	run_until([]() { return pc.received.size() >= 2 && kb.received.size() >= 2; }, 100000);
+	check(same(kb.received, { 0xed, 0x02 }), "PC to keyboard");
+	check(same(pc.received, { 0xfa, 0xfa }), "keyboard ACKs");
+
+	run_until([]() { return false; }, 1000);
+	std::string const &log = usb_host_output;
+	check(log.find("H    <- 1C D\r\n") != std::string::npos, "device to host log");
+	check(log.find("H ED ->    D\r\n") != std::string::npos, "host to device log");
+
+	// a lone clock pulse starts a frame that never completes, the watchdog
+	// has to drop it before the next byte arrives
+	pc.received.clear();
+	sim_drive(SIM_KB_CLOCK, SIM_PEER, true);
+	sim_advance(40);
+	sim_drive(SIM_KB_CLOCK, SIM_PEER, false);
+	sim_advance(300);
+	kb.send(0x2a);
+	run_until([]() { return pc.received.size() >= 1; }, 100000);
+	check(same(pc.received, { 0x2a }) && ps2d.errors == 1, "resync after a clock glitch");
+
+#ifdef DEGLITCH_ENABLED
+	// idle gaps just short of the 4.096 ms wrap of hal_cycles(): the
+	// start bit must not pass for ringing after the previous stop bit
+	pc.received.clear();
+	kb.gap = 4080;
+	for (uint8_t c = 0x15; c < 0x1d; c++) {
+		kb.send(c);
+	}
+	run_until([]() { return pc.received.size() >= 8; }, 100000);
+	kb.gap = 100;
+	check(same(pc.received, { 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c }), "start bit after a 4 ms gap");
+#endif
+
+#ifdef TIMING_ENABLED
+	// a frame cut short, and the next one just after the 4.096 ms wrap
+	// of the cycle count: the gap must not pass for a bit period
+	timing_init(&timing);
+	pc.received.clear();
+	sim_drive(SIM_KB_CLOCK, SIM_PEER, true);
+	sim_advance(40);
+	sim_drive(SIM_KB_CLOCK, SIM_PEER, false);
+	sim_advance(3950);
+	kb.send(0x33);
+	run_until([]() { return pc.received.size() >= 1; }, 100000);
+	usb_host_input += "D";
+	run_until([&log]() { return log.find("D pc rts") != std::string::npos; }, 10000);
+	check(log.find("D kb period 10 1280 1280 1280 : 0 0 0 10 0 0 0 0\r\n") != std::string::npos
+		&& log.find("D kb frame 1 800 800 800 : 0 0 0 1 0 0 0 0\r\n") != std::string::npos, "timing D lines after a cycle wrap");
+#endif
+
+#ifdef SHADOW_ENABLED
+	// the keyboard asks for a resend of a command acknowledged locally:
+	// the shadow retries on its own, and logs what it gives up on
+	pc.received.clear();
+	kb.received.clear();
+	kb.resends = 2;
+	pc.send(0xed);
+	pc.send(0x04);
+	run_until([]() { return kb.received.size() >= 2; }, 200000);
+	check(same(pc.received, { 0xfa, 0xfa }) && same(kb.received, { 0xed, 0x04 }) && ps2_shadow.errors == 0, "shadow resend retry");
+
+	pc.received.clear();
+	kb.received.clear();
+	kb.resends = 8;	// four tries of each byte
+	pc.send(0xed);
+	pc.send(0x01);
+	run_until([&log]() { return log.find("S 01 lost") != std::string::npos; }, 500000);
+	check(same(pc.received, { 0xfa, 0xfa }) && kb.received.empty() && ps2_shadow.errors == 2
+		&& log.find("S ED lost\r\n") != std::string::npos && log.find("S 01 lost\r\n") != std::string::npos, "shadow retries used up");
+	kb.resends = 0;
+#endif
+
+#ifdef KEYSTATE_ENABLED
+	// key state deltas as keys change, and no line while nothing does
+	size_t at = log.size();
+	kb.send(0xaa);	// a self test clears what earlier checks left down
+	run_until([&log, at]() { return log.find("<- AA D", at) != std::string::npos; }, 100000);
+	at = log.size();
+	usb_host_input += "s";
+	kb.send(0x1c);
+	run_until([&log, at]() { return log.find("k 03:10\r\n", at) != std::string::npos; }, 100000);
+	kb.send(0xf0);
+	kb.send(0x1c);
+	run_until([&log, at]() { return log.find("k 03:00\r\n", at) != std::string::npos; }, 100000);
+	bool deltas = log.find("K " + std::string(64, '0'), at) != std::string::npos
+		&& log.find("k 03:10\r\n", at) != std::string::npos && log.find("k 03:00\r\n", at) != std::string::npos;
+	usb_host_input += "S";
+	run_until([]() { return false; }, 350000);
+	usb_host_input += "n";
+	check(deltas && log.find("k\r\n", at) == std::string::npos, "keystate delta lines");
+#endif
+
+	// typematic repeats summarized, an E0 pair as one unit, and the
+	// last run flushed when the keyboard goes quiet
+	size_t start = log.size();
+	usb_host_input += "R";
+	for (int i = 0; i < 5; i++) {
+		kb.send(0x1c);
+	}
+	kb.send(0x32);
+	for (int i = 0; i < 3; i++) {
+		kb.send(0xe0);
+		kb.send(0x75);
+	}
+	run_until([&log, start]() { return log.find(" *2 ", start) != std::string::npos; }, 1500000);
+	usb_host_input += "r";
+	std::string runs = log.substr(start);
+	size_t repeat = runs.find("H    <- 1C D *4 ");
+	check(runs.find("H    <- 1C D\r\nH    <- 1C D *4 ") != std::string::npos
+		&& runs.find("us\r\nH    <- 32 D\r\nH    <- E0 D\r\nH    <- 75 D\r\nH    <- 75 D *2 ", repeat) != std::string::npos
+		&& runs.find("H    <- 1C D\r\n", repeat) == std::string::npos, "run-length summary");
+
+#ifdef MOUSE_ENABLED
+	// a mouse learned from its BAT, packets as M lines, and a byte
+	// without the sync bit logged as it is before the next packet
+	start = log.size();
+	kb.send(0xaa);
+	kb.send(0x00);
+	kb.send(0x29);
+	kb.send(0x05);
+	kb.send(0xfb);
+	kb.send(0x02);
+	kb.send(0x08);
+	kb.send(0x00);
+	kb.send(0x00);
+	run_until([&log, start]() { return log.find("M 00 +0 +0\r\n", start) != std::string::npos; }, 100000);
+	check(log.find("H    <- AA D\r\nH    <- 00 D\r\nM 01 +5 -5\r\nH    <- 02 D\r\nM 00 +0 +0\r\n", start) != std::string::npos
+		&& mouse.sync_errors == 1, "mouse packets and resync");
+
+	// nobody reads the port while the mouse moves at full speed: the
+	// merged lines end before a sum leaves its field
+	start = log.size();
+	usb_host_input += "C";
+	run_until([]() { return usb_host_input.empty(); }, 10000);
+	usb_host_busy = true;
+	for (int i = 0; i < 200; i++) {
+		kb.send(0x28);	// +255 -255
+		kb.send(0xff);
+		kb.send(0x01);
+	}
+	run_until([]() { return kb.tx.empty() && kb.idle(); }, 1000000);
+	usb_host_busy = false;
+	run_until([&log, start]() { return log.find(" *72\r\n", start) != std::string::npos; }, 100000);
+	usb_host_busy = true;
+	mouse.id = MOUSE_ID_INTELLIMOUSE;
+	for (int i = 0; i < 30; i++) {
+		kb.send(0x08);	// wheel +5
+		kb.send(0x00);
+		kb.send(0x00);
+		kb.send(0x05);
+	}
+	run_until([]() { return kb.tx.empty() && kb.idle(); }, 1000000);
+	usb_host_busy = false;
+	run_until([&log, start]() { return log.find(" *5\r\n", start) != std::string::npos; }, 100000);
+	check(log.find("M 00 +32640 -32640 *128\r\nM 00 +18360 -18360 *72\r\n", start) != std::string::npos
+		&& log.find("M 00 +0 +0 +125 *25\r\nM 00 +0 +0 +25 *5\r\n", start) != std::string::npos, "mouse merge in range");
+	usb_host_input += "c";
+	mouse_init(&mouse);	// back to a keyboard
+#endif
+
+#ifdef TRANSLATE_ENABLED
+	// set 1 toward the PC, F0 folded into bit 7 of the next code and
+	// the E0 prefix passed on
+	pc.received.clear();
+	usb_host_input += "T";
+	run_until([]() { return usb_host_input.empty(); }, 10000);
+	for (uint8_t c : { 0x1c, 0xf0, 0x1c, 0xe0, 0x75, 0xe0, 0xf0, 0x75 }) {
+		kb.send(c);
+	}
+	run_until([]() { return pc.received.size() >= 6; }, 100000);
+	usb_host_input += "t";
+	check(same(pc.received, { 0x1e, 0x9e, 0xe0, 0x48, 0xe0, 0xc8 }), "translate F0 folding");
+#endif
+
+#ifdef REMAP_ENABLED
+	// Caps Lock re-encoded as left Ctrl, prefixes kept with their key
+	pc.received.clear();
+	usb_host_input += "M";
+	run_until([]() { return usb_host_input.empty(); }, 10000);
+	for (uint8_t c : { 0x58, 0xf0, 0x58, 0xe0, 0x75, 0xe0, 0xf0, 0x75 }) {
+		kb.send(c);
+	}
+	run_until([]() { return pc.received.size() >= 8; }, 100000);
+	check(same(pc.received, { 0x14, 0xf0, 0x14, 0xe0, 0x75, 0xe0, 0xf0, 0x75 }), "remap re-encode");
+
+	// an EEPROM table that moves F7 (83), the last byte of the ID: the
+	// answer to F2 passes as it is, the same code from a key does not
+	sim_eeprom[REMAP_EEPROM_ADDR] = REMAP_EEPROM_MAGIC;
+	for (int i = 0; i < 256; i++) {
+		sim_eeprom[REMAP_EEPROM_ADDR + 1 + i] = i == 0x83 ? 0x16 : i;
+	}
+	remap_init(&remap);
+	remap_enable(&remap, true);
+	pc.received.clear();
+	pc.send(0xf2);
+	run_until([]() { return pc.received.size() >= 3; }, 100000);
+	kb.send(0x83);
+	run_until([]() { return pc.received.size() >= 4; }, 100000);
+	check(same(pc.received, { 0xfa, 0xab, 0x83, 0x16 }), "remap passes a response");
+	memset(sim_eeprom, 0xff, 257);
+	remap_init(&remap);
+#endif
+
+#ifdef REPLAY_ENABLED
+	// records sent on their recorded schedule, a pure delay chained in;
+	// the end record waits at most for the frame of the one before it
+	start = log.size();
+	pc.received.clear();
+	pc.received_at.clear();
+	std::string capture = "Y";
+	auto record = [&capture](uint8_t flags, uint8_t c, uint16_t delta) {
+		capture += (char)flags;
+		capture += (char)c;
+		capture += (char)(delta & 0xff);
+		capture += (char)(delta >> 8);
+	};
+	record(REPLAY_TO_PC, 0x1c, 0);
+	record(REPLAY_TO_PC, 0xf0, 5000);
+	record(0, 0, 20000);
+	record(REPLAY_TO_PC, 0x1c, 10000);
+	record(REPLAY_END, 0, 0);
+	usb_host_input += capture;
+	run_until([]() { return pc.received.size() >= 3; }, 100000);
+	run_until([&log, start]() { return log.find("Y 5 late ", start) != std::string::npos; }, 10000);
+	unsigned late = ~0u;
+	size_t y = log.find("Y 5 late ", start);
+	if (y != std::string::npos) sscanf(log.c_str() + y, "Y 5 late %u", &late);
+	check(same(pc.received, { 0x1c, 0xf0, 0x1c }) && late < 1000
+		&& pc.received_at[1] - pc.received_at[0] > 4900 && pc.received_at[1] - pc.received_at[0] < 5100
+		&& pc.received_at[2] - pc.received_at[1] > 29900 && pc.received_at[2] - pc.received_at[1] < 30100, "replay timing");
+
+	// an upload cut short in its second record: the replay gives up and
+	// the commands work again
+	start = log.size();
+	pc.received.clear();
+	capture = "Y";
+	record(REPLAY_TO_PC, 0x1c, 0);
+	capture += (char)REPLAY_TO_PC;
+	capture += (char)0x32;
+	usb_host_input += capture;
+	run_until([&log, start]() { return log.find(" timeout\r\n", start) != std::string::npos; }, 1100000);
+	capture = "Y";
+	record(REPLAY_END, 0, 0);
+	usb_host_input += capture;
+	run_until([&log, start]() { return log.find("Y 1 late 0\r\n", start) != std::string::npos; }, 10000);
+	check(same(pc.received, { 0x1c }) && log.find("Y 1 late 0 timeout\r\n", start) != std::string::npos
+		&& log.find("Y 1 late 0\r\n", start) != std::string::npos, "replay upload cut short");
+#endif
+
+#ifdef GENERATOR_ENABLED
+	// the flood answers the PC itself: F5 holds it, FE repeats the last
+	// byte, F4 lets it go on
+	start = log.size();
+	pc.received.clear();
+	usb_host_input += "G";
+	run_until([]() { return pc.received.size() >= 10; }, 100000);
+	pc.send(0xf5);
+	run_until([]() { return pc.received.back() == 0xfa; }, 100000);
+	run_until([]() { return false; }, 20000);
+	bool held = pc.received.back() == 0xfa;
+	pc.received.clear();
+	pc.send(0xfe);
+	run_until([]() { return false; }, 20000);
+	bool resent = same(pc.received, { 0xfa });
+	pc.received.clear();
+	pc.send(0xf4);
+	run_until([]() { return pc.received.size() >= 5; }, 100000);
+	usb_host_input += "g";
+	run_until([&log, start]() { return log.find("G ", start) != std::string::npos; }, 10000);
+	run_until([]() { return ps2h.output_queue.len == 0 && pc.idle(); }, 10000);
+	pc.received.resize(5);
+	check(held && resent && same(pc.received, { 0xfa, 0x1c, 0x1c, 0x1c, 0x1c })
+		&& log.find(" ack 2 resend 1 ", start) != std::string::npos, "generator F4/F5/FE answers");
+#endif
+
+#ifdef HOSTEMU_ENABLED
+	// the keyboard benchmark: 16 rounds of five commands, reported in
+	// four lines, none of the keyboard's replies relayed to the PC
+	start = log.size();
+	pc.received.clear();
+	usb_host_input += "B";
+	run_until([&log, start]() { return log.find("B timeouts", start) != std::string::npos; }, 2000000);
+	check(log.find("B bat 16 5 5 5 :", start) != std::string::npos
+		&& log.find("B ack 80 ", start) != std::string::npos
+		&& log.find("B clock 960 1280 1280 1280 :", start) != std::string::npos
+		&& log.find("B timeouts 0 resends 0 errors 0\r\n", start) != std::string::npos
+		&& pc.received.empty(), "hostemu report");
+#endif
+
+	// a PC that holds its clock: the keyboard is held once eight bytes
+	// wait for the PC, and let go when they are down to four
+	pc.received.clear();
+	unsigned long holds = ps2d.flow_holds;
+	pc.hold(50000);
+	for (uint8_t c = 0x15; c < 0x29; c++) {
+		kb.send(c);
+	}
+	run_until([]() { return false; }, 40000);
+	bool holding = ps2d.flow_held && ps2h.output_queue.len >= 8 && ps2h.output_queue.len <= 10 && !kb.tx.empty();
+	run_until([]() { return pc.received.size() >= 20; }, 100000);
+	std::vector<uint8_t> flow_bytes;
+	for (uint8_t c = 0x15; c < 0x29; c++) {
+		flow_bytes.push_back(c);
+	}
+	check(holding && pc.received == flow_bytes && !ps2d.flow_held && ps2d.flow_holds > holds, "flow hold and release");
+
+	// a queue in a burst borrows every block nobody else is promised, and
+	// the keyboard input still gets its reserve
+	static Queue burst;
+	queue_init(&burst, 1, 255);
+	unsigned expected = (queue_arena.nfree - queue_arena.owed + 1) * QUEUE_BLOCK;
+	unsigned n = 0;
+	while (queue_put(&burst, n & 0xff)) {
+		n++;
+	}
+	bool reserve = true;
+	for (uint8_t i = 0; i < 16; i++) {
+		reserve = reserve && queue_put(&ps2d.input_queue, i);
+	}
+	unsigned got = 0;
+	while (queue_get(&burst) == (int)(got & 0xff)) {
+		got++;
+	}
+	queue_clear(&ps2d.input_queue);
+	check(n == expected && reserve && got == n && queue_arena.nfree == QUEUE_BLOCKS, "queue arena borrowing");
+
+	usb_host_input += "Q";
+	run_until([&log]() { return log.find("Q arena") != std::string::npos; }, 10000);
+	check(log.find("Q kb in 0 peak 16 blocks 0 borrowed 0 drops 0\r\n") != std::string::npos, "queue report");
+
+	// text beyond REPORT_LINE_MAX is cut off, the line stays whole
+	print("cut ");
+	print(std::string(30, 'x').c_str());
+	print(std::string(70, 'y').c_str());
+	print_crlf();
+	std::string cut = "cut " + std::string(30, 'x') + std::string(44, 'y') + "\r\n";
+	run_until([&log, &cut]() { return log.find(cut) != std::string::npos; }, 10000);
+	check(log.find(cut) != std::string::npos, "long line cut off");
+
+	// posted tasks and tasks due by their period run in table order, one
+	// per sched_poll(); a start later than the deadline is a miss
+	static SchedTask const tasks[SCHED_TASKS] = {
+		{ []() { order += 'r'; }, 0, 100 },
+		{ []() { order += 't'; }, 1000, 1000 },
+		{ []() { order += 'x'; }, 0, 5000 },
+		{ nullptr, 0, 0 },
+		{ nullptr, 0, 0 },
+	};
+	sched_init(tasks);
+	sched_post(2);
+	sched_post(0);
+	sim_advance(1000);
+	while (sched_poll()) {
+	}
+	check(order == "rtx" && sched_stats[0].misses == 1 && sched_stats[1].misses == 0 && sched_stats[2].misses == 0, "scheduler order and deadlines");
+
+	// the main loop of the firmware sleeps between the keyboard's bytes,
+	// every wake-up reaches its task within half a bit time
+	sim_main_init();
+	pc.received.clear();
+	for (uint8_t c : { 0x1c, 0xf0, 0x1c }) {
+		kb.send(c);
+		uint64_t end = sim_now() + 5000;
+		while (sim_now() < end) {
+			sim_main_pass(5);
+		}
+	}
+	SchedSleep z = sched_sleep_stats;
+	check(same(pc.received, { 0x1c, 0xf0, 0x1c }) && z.sleeps > 0 && z.wake_max < SCHED_WAKE_DEADLINE && z.misses == 0, "idle sleep");
+
+	// a keyboard flood keeps the relay busy clocking bytes out to the PC,
+	// a command still gets through long before the flood is over
+	pc.received.clear();
+	kb.half_period = 30;	// 16.7 kHz
+	kb.gap = 20;
+	for (unsigned i = 0; i < 300; i++) {
+		kb.send(1 + i % 0x7f);
+	}
+	uint64_t end = sim_now() + 300000;
+	while (sim_now() < end && pc.received.size() < 20) {
+		sim_main_pass(5);
+	}
+	size_t from = log.size();
+	usb_host_input += "Q";
+	while (sim_now() < end && log.find("Q arena", from) == std::string::npos) {
+		sim_main_pass(5);
+	}
+	size_t flooded = pc.received.size();
+	while (sim_now() < end && pc.received.size() < 300) {
+		sim_main_pass(5);
+	}
+	kb.half_period = 40;
+	kb.gap = 100;
+	check(log.find("Q arena", from) != std::string::npos && flooded < 30 && pc.received.size() == 300, "command during a keyboard flood");
+
+	if (getenv("HOST_LOG")) fputs(log.c_str(), stdout);
+	printf("%s\n", failures ? "FAILED" : "passed");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,346 @@
+
+#include "models.h"
+#include "sim.h"
+
+uint8_t sim_parity(uint8_t c)
+{
+	uint8_t n = 0;
+	for (; c; c >>= 1) {
+		n += c & 1;
+	}
+	return !(n & 1);
+}
+
+// keyboard
+
+void SimKeyboard::later(uint32_t us, void (SimKeyboard::*fn)())
+{
+	unsigned g = gen;
+	sim_after(us, [this, g, fn]() {
+		if (g == gen) (this->*fn)();
+	});
+}
+
+void SimKeyboard::attach()
+{
+	sim_listen([this](int line, bool level) { changed(line, level); });
+}
+
+void SimKeyboard::send(uint8_t c)
+{
+	tx.push_back(c);
+	kick();
+}
+
+bool SimKeyboard::idle() const
+{
+	return state == IDLE && tx.empty() && reply.empty();
+}
+
+void SimKeyboard::kick()
+{
+	if (state == IDLE) {
+		gen++;
+		later(gap, &SimKeyboard::start_send);
+	}
+}
+
+void SimKeyboard::changed(int line, bool level)
+{
+	if (line != SIM_KB_CLOCK) return;
+	if (!level) {
+		if (state == SENDING && !sim_driven(SIM_KB_CLOCK, SIM_PEER)) {
+			abort_send();	// the host inhibits communication
+		}
+		return;
+	}
+	if (state != RECEIVING && !sim_get(SIM_KB_DATA) && !sim_driven(SIM_KB_DATA, SIM_PEER)) {
+		if (state == SENDING) abort_send();
+		state = RECEIVING;	// request to send
+		bit = 0;
+		frame = 0;
+		gen++;
+		later(half_period, &SimKeyboard::rx_low);
+		return;
+	}
+	if (state == IDLE) kick();
+}
+
+void SimKeyboard::start_send()
+{
+	if (state != IDLE) return;
+	if (!sim_get(SIM_KB_CLOCK) || !sim_get(SIM_KB_DATA)) return;	// wait for the clock to be released
+	sending_reply = !reply.empty();
+	if (!sending_reply && tx.empty()) return;
+	uint8_t c = sending_reply ? reply.front() : tx.front();
+	frame = ((0x200 | (sim_parity(c) << 8) | c) << 1);
+	bit = 0;
+	state = SENDING;
+	send_data();
+}
+
+void SimKeyboard::send_data()
+{
+	sim_drive(SIM_KB_DATA, SIM_PEER, !((frame >> bit) & 1));
+	later(half_period / 2, &SimKeyboard::send_low);
+}
+
+void SimKeyboard::send_low()
+{
+	sim_drive(SIM_KB_CLOCK, SIM_PEER, true);
+	later(half_period, &SimKeyboard::send_high);
+}
+
+void SimKeyboard::send_high()
+{
+	sim_drive(SIM_KB_CLOCK, SIM_PEER, false);
+	if (state != SENDING) return;	// aborted by the host
+	if (++bit == 11) {
+		sim_drive(SIM_KB_DATA, SIM_PEER, false);
+		state = IDLE;
+		if (sending_reply) {
+			last = reply.front();
+			reply.pop_front();
+		} else {
+			last = tx.front();
+			tx.pop_front();
+		}
+		sent_bytes.push_back(last);
+		sent_at.push_back(sim_now());
+		sent++;
+		kick();
+		return;
+	}
+	if (!sim_get(SIM_KB_CLOCK)) {
+		abort_send();
+		return;
+	}
+	later(half_period / 2, &SimKeyboard::send_data);
+}
+
+void SimKeyboard::abort_send()
+{
+	gen++;
+	state = IDLE;
+	aborts++;
+	sim_drive(SIM_KB_DATA, SIM_PEER, false);
+	sim_drive(SIM_KB_CLOCK, SIM_PEER, false);
+}
+
+void SimKeyboard::rx_low()
+{
+	if (bit == 10) {
+		sim_drive(SIM_KB_DATA, SIM_PEER, true);	// acknowledge, valid at the falling edge
+	}
+	sim_drive(SIM_KB_CLOCK, SIM_PEER, true);
+	later(half_period, &SimKeyboard::rx_high);
+}
+
+void SimKeyboard::rx_high()
+{
+	if (bit < 10 && sim_get(SIM_KB_DATA)) {
+		frame |= 1 << bit;
+	}
+	sim_drive(SIM_KB_CLOCK, SIM_PEER, false);
+	if (++bit <= 10) {
+		later(half_period, &SimKeyboard::rx_low);
+		return;
+	}
+	sim_drive(SIM_KB_DATA, SIM_PEER, false);
+	state = IDLE;
+	uint8_t c = frame & 0xff;
+	if (((frame >> 8) & 1) != sim_parity(c) || !(frame & 0x200)) {
+		rx_errors++;
+		reply.push_back(0xfe);
+	} else if (resends) {
+		resends--;
+		reply.push_back(0xfe);
+	} else {
+		received.push_back(c);
+		respond(c);
+	}
+	kick();
+}
+
+void SimKeyboard::respond(uint8_t c)
+{
+	if (expect_arg && c < 0x80) {
+		expect_arg = false;
+		reply.push_back(0xfa);
+		if (cmd == 0xf0 && c == 0) reply.push_back(0x02);
+		return;
+	}
+	expect_arg = false;
+	switch (c) {
+	case 0xed:
+	case 0xf3:
+	case 0xf0:
+		reply.push_back(0xfa);
+		cmd = c;
+		expect_arg = true;
+		break;
+	case 0xff:
+		reply.clear();
+		tx.clear();
+		reply.push_back(0xfa);
+		sim_after(bat_delay, [this]() {
+			reply.push_back(0xaa);
+			kick();
+		});
+		break;
+	case 0xf2:
+		reply.push_back(0xfa);
+		reply.push_back(0xab);
+		reply.push_back(0x83);
+		break;
+	case 0xee:
+		reply.push_back(0xee);
+		break;
+	case 0xfe:
+		reply.push_back(last);
+		break;
+	default:
+		reply.push_back(0xfa);
+		break;
+	}
+}
+
+// PC
+
+void SimPC::later(uint32_t us, void (SimPC::*fn)())
+{
+	unsigned g = gen;
+	sim_after(us, [this, g, fn]() {
+		if (g == gen) (this->*fn)();
+	});
+}
+
+void SimPC::attach()
+{
+	sim_listen([this](int line, bool level) { changed(line, level); });
+}
+
+void SimPC::send(uint8_t c)
+{
+	tx.push_back(c);
+	kick();
+}
+
+bool SimPC::idle() const
+{
+	return state == IDLE && tx.empty();
+}
+
+void SimPC::kick()
+{
+	if (state == IDLE) {
+		gen++;
+		later(gap, &SimPC::start_send);
+	}
+}
+
+void SimPC::changed(int line, bool level)
+{
+	if (level || !sim_driven(line, SIM_FIRMWARE) || sim_driven(line, SIM_PEER)) return;
+	if (line == SIM_PC_CLOCK) {	// falling edge clocked by the firmware
+		if (state == SENDING) {
+			tx_edge();
+		} else {
+			rx_edge();
+		}
+	} else if (line == SIM_PC_DATA && await_ack) {
+		tx_done(true);
+	}
+}
+
+void SimPC::start_send()
+{
+	if (state != IDLE || tx.empty()) return;
+	sim_drive(SIM_PC_CLOCK, SIM_PEER, true);	// inhibit
+	state = INHIBIT;
+	later(inhibit, &SimPC::request_to_send);
+}
+
+void SimPC::hold(uint32_t us)
+{
+	if (state != IDLE) return;
+	gen++;
+	sim_drive(SIM_PC_CLOCK, SIM_PEER, true);
+	state = HOLD;
+	later(us, &SimPC::release);
+}
+
+void SimPC::release()
+{
+	sim_drive(SIM_PC_CLOCK, SIM_PEER, false);
+	state = IDLE;
+	kick();
+}
+
+void SimPC::request_to_send()
+{
+	sim_drive(SIM_PC_DATA, SIM_PEER, true);	// start bit
+	sim_drive(SIM_PC_CLOCK, SIM_PEER, false);
+	state = SENDING;
+	tx_bit = 0;
+	later(20000, &SimPC::tx_timeout);
+}
+
+void SimPC::tx_edge()
+{
+	uint8_t c = tx.front();
+	uint8_t k = ++tx_bit;
+	if (k <= 8) {
+		sim_drive(SIM_PC_DATA, SIM_PEER, !((c >> (k - 1)) & 1));
+	} else if (k == 9) {
+		sim_drive(SIM_PC_DATA, SIM_PEER, !sim_parity(c));
+	} else if (k == 10) {
+		sim_drive(SIM_PC_DATA, SIM_PEER, false);	// stop bit
+		await_ack = true;
+	}
+}
+
+void SimPC::tx_done(bool ok)
+{
+	gen++;
+	await_ack = false;
+	sim_drive(SIM_PC_DATA, SIM_PEER, false);
+	sim_drive(SIM_PC_CLOCK, SIM_PEER, false);
+	state = IDLE;
+	if (ok) {
+		tx.pop_front();
+		sent++;
+	} else {
+		tx_errors++;
+	}
+	kick();
+}
+
+void SimPC::tx_timeout()
+{
+	tx_done(false);
+}
+
+void SimPC::rx_edge()
+{
+	uint64_t now = sim_now();
+	if (now - rx_last > 200) {
+		rx_bit = 0;	// a new frame, or an aborted one was abandoned
+		rx_frame = 0;
+	}
+	rx_last = now;
+	if (sim_get(SIM_PC_DATA)) {
+		rx_frame |= 1 << rx_bit;
+	}
+	if (++rx_bit < 11) return;
+	rx_bit = 0;
+	uint8_t c = (rx_frame >> 1) & 0xff;
+	bool ok = !(rx_frame & 1) && (rx_frame & 0x400) && ((rx_frame >> 9) & 1) == sim_parity(c);
+	if (ok) {
+		received.push_back(c);
+		received_at.push_back(now);
+	} else {
+		rx_errors++;
+	}
+	rx_frame = 0;
+}
@@ -0,0 +1,93 @@
+#ifndef MODELS_H
+#define MODELS_H
+
+#include <stdint.h>
+#include <deque>
+#include <vector>
+
+// emulated peers on the simulated buses
+
+// keyboard on the device side: sends scan codes, answers commands
+class SimKeyboard {
+public:
+	uint32_t half_period = 40;	// us, 12.5 kHz
+	uint32_t gap = 100;			// us between bytes
+	uint32_t bat_delay = 5000;	// us from reset to AA
+	unsigned resends = 0;		// the next n bytes from the host are answered FE
+	std::deque<uint8_t> tx;
+	std::vector<uint8_t> received;
+	std::vector<uint8_t> sent_bytes;	// every completed frame, replies included
+	std::vector<uint64_t> sent_at;
+	unsigned long sent = 0;
+	unsigned long aborts = 0;
+	unsigned long rx_errors = 0;
+
+	void attach();
+	void send(uint8_t c);
+	bool idle() const;
+
+private:
+	enum { IDLE, SENDING, RECEIVING } state = IDLE;
+	std::deque<uint8_t> reply;
+	bool sending_reply = false;
+	uint8_t last = 0;
+	uint8_t cmd = 0;
+	bool expect_arg = false;
+	int bit = 0;
+	uint16_t frame = 0;
+	unsigned gen = 0;
+
+	void later(uint32_t us, void (SimKeyboard::*fn)());
+	void changed(int line, bool level);
+	void kick();
+	void start_send();
+	void send_data();
+	void send_low();
+	void send_high();
+	void abort_send();
+	void rx_low();
+	void rx_high();
+	void respond(uint8_t c);
+};
+
+// PC on the host side: receives what the firmware clocks out, sends commands
+class SimPC {
+public:
+	uint32_t inhibit = 100;		// us before request to send
+	uint32_t gap = 100;
+	std::deque<uint8_t> tx;
+	std::vector<uint8_t> received;
+	std::vector<uint64_t> received_at;
+	unsigned long sent = 0;
+	unsigned long rx_errors = 0;
+	unsigned long tx_errors = 0;
+
+	void attach();
+	void send(uint8_t c);
+	void hold(uint32_t us);	// inhibit the bus, e.g. while the PC is busy
+	bool idle() const;
+
+private:
+	enum { IDLE, INHIBIT, HOLD, SENDING } state = IDLE;
+	int rx_bit = 0;
+	uint16_t rx_frame = 0;
+	uint64_t rx_last = 0;
+	int tx_bit = 0;
+	bool await_ack = false;
+	unsigned gen = 0;
+
+	void later(uint32_t us, void (SimPC::*fn)());
+	void changed(int line, bool level);
+	void kick();
+	void start_send();
+	void request_to_send();
+	void release();
+	void tx_edge();
+	void tx_done(bool ok);
+	void tx_timeout();
+	void rx_edge();
+};
+
+uint8_t sim_parity(uint8_t c);	// odd parity bit for c
+
+#endif // MODELS_H
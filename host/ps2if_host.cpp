@@ -0,0 +1,82 @@
+
+#include "ps2if.h"
+#include "sim.h"
+
+// pin backend on top of the simulated lines
+
+void ps2if_init()
+{
+	for (int i = 0; i < SIM_LINES; i++) {
+		sim_drive(i, SIM_FIRMWARE, false);
+	}
+}
+
+void pc_set_clock_0()
+{
+	sim_drive(SIM_PC_CLOCK, SIM_FIRMWARE, true);
+}
+
+void pc_set_clock_1()
+{
+	sim_drive(SIM_PC_CLOCK, SIM_FIRMWARE, false);
+}
+
+void pc_set_data_0()
+{
+	sim_drive(SIM_PC_DATA, SIM_FIRMWARE, true);
+}
+
+void pc_set_data_1()
+{
+	sim_drive(SIM_PC_DATA, SIM_FIRMWARE, false);
+}
+
+bool pc_get_clock()
+{
+	return sim_sense(SIM_PC_CLOCK);
+}
+
+bool pc_get_data()
+{
+	return sim_sense(SIM_PC_DATA);
+}
+
+bool pc_clock_driven()
+{
+	return sim_driven(SIM_PC_CLOCK, SIM_FIRMWARE);
+}
+
+void kb0_set_clock_0()
+{
+	sim_drive(SIM_KB_CLOCK, SIM_FIRMWARE, true);
+}
+
+void kb0_set_clock_1()
+{
+	sim_drive(SIM_KB_CLOCK, SIM_FIRMWARE, false);
+}
+
+void kb0_set_data_0()
+{
+	sim_drive(SIM_KB_DATA, SIM_FIRMWARE, true);
+}
+
+void kb0_set_data_1()
+{
+	sim_drive(SIM_KB_DATA, SIM_FIRMWARE, false);
+}
+
+bool kb0_get_clock()
+{
+	return sim_sense(SIM_KB_CLOCK);
+}
+
+bool kb0_get_data()
+{
+	return sim_sense(SIM_KB_DATA);
+}
+
+bool kb0_clock_driven()
+{
+	return sim_driven(SIM_KB_CLOCK, SIM_FIRMWARE);
+}
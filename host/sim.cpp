@@ -0,0 +1,342 @@
+
+#include "sim.h"
+#include "hal.h"
+#include "cdc.h"
+#include "report.h"
+#include "sched.h"
+#include "waitloop.h"
+#include <string.h>
+#include <map>
+#include <random>
+#include <vector>
+
+extern "C" void INT0_vect();
+extern "C" void INT5_vect();
+extern "C" void TIMER1_COMPA_vect();
+void ps2_loop();
+bool ps2_idle();
+
+uint8_t interval_1ms_flag = 0;
+
+enum {
+	IRQ_INT0 = 0x01,
+	IRQ_INT5 = 0x02,
+	IRQ_TIMER1 = 0x04,
+};
+
+static uint64_t now;
+static uint64_t next_tick;
+static uint64_t timeout_at;
+static uint64_t seq;
+static std::map<std::pair<uint64_t, uint64_t>, SimEvent> events;
+static std::vector<SimListener> listeners;
+static bool driven[SIM_LINES][2];
+static int glitched[SIM_LINES];
+static bool irq_enabled;
+static uint8_t irq_pending;
+static int depth;	// inside an event or an interrupt handler
+static uint64_t isr_count;
+static std::vector<SimEvent> isr_hooks;
+static uint32_t preempt_max;
+uint8_t sim_eeprom[1024];
+static std::mt19937 preempt_rng;
+
+uint64_t sim_now()
+{
+	return now;
+}
+
+void sim_reset()
+{
+	now = 0;
+	next_tick = 1000;
+	timeout_at = UINT64_MAX;
+	seq = 0;
+	events.clear();
+	listeners.clear();
+	for (int i = 0; i < SIM_LINES; i++) {
+		driven[i][SIM_FIRMWARE] = false;
+		driven[i][SIM_PEER] = false;
+		glitched[i] = 0;
+	}
+	irq_enabled = false;
+	irq_pending = 0;
+	depth = 0;
+	isr_hooks.clear();
+	preempt_max = 0;
+	interval_1ms_flag = 0;
+	memset(sim_eeprom, 0xff, sizeof(sim_eeprom));
+}
+
+void sim_set_preempt(uint32_t max_us, unsigned seed)
+{
+	preempt_max = max_us;
+	preempt_rng.seed(seed);
+}
+
+static void preempt()
+{
+	if (preempt_max == 0 || depth > 0 || !irq_enabled) return;
+	sim_advance(preempt_rng() % (preempt_max + 1));
+}
+
+void hal_preempt_point()
+{
+	preempt();
+}
+
+void sim_on_isr(SimEvent fn)
+{
+	isr_hooks.push_back(fn);
+}
+
+// interrupts
+
+static void dispatch()
+{
+	while (irq_enabled && irq_pending) {
+		uint8_t irq = irq_pending & -irq_pending;	// lowest vector first
+		irq_pending &= ~irq;
+		irq_enabled = false;	// cleared on entry, set again by reti
+		isr_count++;
+		depth++;
+		if (irq == IRQ_INT0) {
+			INT0_vect();
+		} else if (irq == IRQ_INT5) {
+			INT5_vect();
+		} else {
+			TIMER1_COMPA_vect();
+		}
+		for (auto &fn : isr_hooks) {
+			fn();
+		}
+		depth--;
+		irq_enabled = true;
+	}
+}
+
+// raised by a peer, the interrupt runs once its event is done, so time
+// spent in the handler does not shift the peer's own timing
+static void raise(uint8_t irq)
+{
+	irq_pending |= irq;
+	if (depth == 0) dispatch();
+}
+
+bool sim_irq_enabled()
+{
+	return irq_enabled;
+}
+
+void hal_irq_disable()
+{
+	irq_enabled = false;
+}
+
+void hal_irq_enable()
+{
+	irq_enabled = true;
+	dispatch();
+	preempt();
+}
+
+uint8_t hal_irq_save()
+{
+	uint8_t state = irq_enabled;
+	irq_enabled = false;
+	return state;
+}
+
+void hal_irq_restore(uint8_t state)
+{
+	if (state) {
+		hal_irq_enable();
+	} else {
+		irq_enabled = false;
+	}
+}
+
+// idle sleep, entered with interrupts disabled like on the AVR
+
+void hal_sleep()
+{
+	uint64_t wake = (now / 128 + 1) * 128;	// Timer0 overflow
+	uint64_t count = isr_count;
+	irq_enabled = true;
+	dispatch();
+	while (isr_count == count && now < wake) {
+		sim_advance(1);
+	}
+}
+
+// Timer1 compare
+
+void hal_timeout_init()
+{
+	hal_timeout_cancel();
+}
+
+void hal_timeout_arm(uint16_t us)
+{
+	timeout_at = now + us;
+	irq_pending &= ~IRQ_TIMER1;
+}
+
+void hal_timeout_cancel()
+{
+	timeout_at = UINT64_MAX;
+	irq_pending &= ~IRQ_TIMER1;
+}
+
+uint16_t hal_cycles()
+{
+	return (uint16_t)(now * 16);
+}
+
+uint8_t eeprom_read_byte(const uint8_t *addr)
+{
+	return sim_eeprom[(uintptr_t)addr % sizeof(sim_eeprom)];
+}
+
+// lines
+
+bool sim_get(int line)
+{
+	return !(driven[line][SIM_FIRMWARE] || driven[line][SIM_PEER]);
+}
+
+bool sim_driven(int line, int who)
+{
+	return driven[line][who];
+}
+
+void sim_drive(int line, int who, bool low)
+{
+	bool before = sim_get(line);
+	driven[line][who] = low;
+	bool after = sim_get(line);
+	if (before == after) return;
+
+	for (auto &fn : listeners) {
+		fn(line, after);
+	}
+	if (line == SIM_KB_CLOCK) {
+		raise(IRQ_INT0);
+	} else if (line == SIM_PC_CLOCK) {
+		raise(IRQ_INT5);
+	}
+}
+
+bool sim_sense(int line)
+{
+	return sim_get(line) ^ (glitched[line] > 0);
+}
+
+static void glitch_edge(int line)
+{
+	if (line == SIM_KB_CLOCK) {
+		raise(IRQ_INT0);
+	} else if (line == SIM_PC_CLOCK) {
+		raise(IRQ_INT5);
+	}
+}
+
+void sim_glitch(int line, uint32_t width)
+{
+	sim_after(width, [line]() {	// before the interrupt lets time pass
+		if (--glitched[line] == 0) glitch_edge(line);
+	});
+	if (glitched[line]++ == 0) glitch_edge(line);
+}
+
+void sim_listen(SimListener fn)
+{
+	listeners.push_back(fn);
+}
+
+// time
+
+void sim_at(uint64_t t, SimEvent fn)
+{
+	events[std::make_pair(t < now ? now : t, seq++)] = fn;
+}
+
+void sim_after(uint32_t us, SimEvent fn)
+{
+	sim_at(now + us, fn);
+}
+
+void sim_advance(uint32_t us)
+{
+	uint64_t end = now + us;
+	while (1) {
+		bool due = !events.empty() && events.begin()->first.first <= end;
+		uint64_t t = due ? events.begin()->first.first : end;
+		if (next_tick <= t) {	// Timer0 interval
+			now = next_tick;
+			next_tick += 1000;
+			interval_1ms_flag = 1;
+			continue;
+		}
+		if (timeout_at <= t) {	// Timer1 compare match
+			now = timeout_at;
+			timeout_at = UINT64_MAX;
+			raise(IRQ_TIMER1);
+			continue;
+		}
+		if (!due) break;
+		now = t;
+		SimEvent fn = events.begin()->second;
+		events.erase(events.begin());
+		depth++;
+		fn();
+		depth--;
+		dispatch();
+	}
+	now = end;
+}
+
+uint32_t micros()
+{
+	return (uint32_t)now;
+}
+
+// busy waits of the firmware
+
+void waitloop(unsigned int n)
+{
+	sim_advance(n);
+}
+
+void msleep(unsigned int ms)
+{
+	sim_advance(ms * 1000);
+}
+
+void wait_100ms()
+{
+	msleep(100);
+}
+
+void wait_1s()
+{
+	msleep(1000);
+}
+
+static SchedTask const main_tasks[SCHED_TASKS] = SCHED_MAIN_TASKS(nullptr);	// without the LCD
+
+void sim_main_init()
+{
+	sched_init(main_tasks);
+}
+
+void sim_main_pass(uint32_t run_us)
+{
+	if (sched_poll()) {
+		sim_advance(run_us);
+	} else if (ps2_idle() && usb_tx_idle()) {
+		sched_sleep();
+	} else {
+		sim_advance(1);
+	}
+}
@@ -0,0 +1,64 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <functional>
+
+// virtual time simulator of the two PS/2 buses
+//
+// Every line is open collector: it reads low if the firmware or the
+// peer (emulated keyboard or PC) pulls it low. Busy waits in the
+// firmware advance virtual time, and clock line changes raise INT0
+// (keyboard side) and INT5 (PC side) like the pin change interrupts.
+
+enum {
+	SIM_KB_CLOCK,
+	SIM_KB_DATA,
+	SIM_PC_CLOCK,
+	SIM_PC_DATA,
+	SIM_LINES,
+};
+
+enum {
+	SIM_FIRMWARE,
+	SIM_PEER,
+};
+
+typedef std::function<void()> SimEvent;
+typedef std::function<void(int line, bool level)> SimListener;
+
+uint64_t sim_now();
+void sim_reset();
+
+void sim_drive(int line, int who, bool low);
+bool sim_get(int line);
+bool sim_driven(int line, int who);
+void sim_listen(SimListener fn);
+
+// noise at the firmware's pins only, the emulated peers see clean lines:
+// the line reads inverted for width us, and a clock line interrupts at
+// both ends of the glitch
+void sim_glitch(int line, uint32_t width);
+bool sim_sense(int line);	// the level the firmware reads
+
+void sim_at(uint64_t t, SimEvent fn);
+void sim_after(uint32_t us, SimEvent fn);
+void sim_advance(uint32_t us);
+
+bool sim_irq_enabled();
+void sim_on_isr(SimEvent fn);
+
+// ISR preemption injection: at every preemption point of the main loop
+// (hal_preempt_point(), end of a critical section) a random 0..max_us of
+// virtual time passes, so interrupts interleave with main loop code.
+void sim_set_preempt(uint32_t max_us, unsigned seed);
+
+// the firmware's main(): the task table of main.cpp without the LCD,
+// every task run takes run_us on top of its busy waits, and the idle
+// sleep when nothing is left to do
+void sim_main_init();
+void sim_main_pass(uint32_t run_us);
+
+extern uint8_t sim_eeprom[1024];	// backs eeprom_read_byte()
+
+#endif // SIM_H
@@ -0,0 +1,222 @@
+
+// stress run of the relay on the simulated buses
+//
+// An emulated keyboard streams scan codes at a given clock rate while the
+// emulated PC sends commands and inhibits the bus. The firmware runs its
+// main loop from the scheduler with the task table of main.cpp, every
+// task run taking -l us, and sleeps when idle. Reports dropped bytes,
+// queue high-water marks, relay latency and the longest wait of a main
+// loop task.
+//
+//  ps2sniffer-sim [-r hz] [-n bytes] [-g gap_us] [-c cmd_ms] [-i inhibit_ms]
+//                 [-p preempt_us] [-l run_us] [-z glitches_per_s] [-s seed]
+//
+// Without -r the rates 10, 12.5, 14.3 and 16.7 kHz are swept. With -z the
+// sweep is over noise instead, at -r or 12.5 kHz: 0, 1/4, 1/2 and all of
+// the given rate of 1 us glitches, at random on the keyboard clock and
+// data pins (see sim_glitch()). Build with -DDEGLITCH_ENABLED to compare.
+
+#include "cdc.h"
+#include "hal.h"
+#include "models.h"
+#include "ps2if.h"
+#include "report.h"
+#include "sched.h"
+#include "sim.h"
+#include "usb.h"
+#include <functional>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+void keyboard_setup();
+extern PS2IF ps2h;
+extern PS2IF ps2d;
+
+struct Options {
+	unsigned rate = 0;
+	unsigned bytes = 2000;
+	unsigned gap = 50;
+	unsigned cmd_ms = 0;
+	unsigned inhibit_ms = 0;
+	unsigned preempt = 0;
+	unsigned run_us = 10;
+	unsigned noise = 0;
+	unsigned seed = 1;
+};
+
+struct Result {
+	unsigned long kb_sent = 0;
+	unsigned long pc_received = 0;
+	unsigned long up_dropped = 0;
+	unsigned long down_sent = 0;
+	unsigned long down_dropped = 0;
+	unsigned long errors = 0;
+	unsigned long corrupted = 0;
+	uint8_t hwm_dev_in = 0;
+	uint8_t hwm_dev_out = 0;
+	uint8_t hwm_host_in = 0;
+	uint8_t hwm_host_out = 0;
+	double latency_avg = 0;
+	uint64_t latency_max = 0;
+	uint16_t task_late = 0;	// us, the longest wait of a main loop task
+	uint64_t elapsed = 0;
+};
+
+static Result run(Options const &opt, unsigned rate, unsigned noise)
+{
+	Result r;
+	SimKeyboard kb;
+	SimPC pc;
+	std::mt19937 rng(opt.seed);
+
+	sim_reset();
+	kb.half_period = 500000 / rate;
+	kb.gap = opt.gap;
+	kb.attach();
+	pc.attach();
+	usb_init();
+	keyboard_setup();
+	report_init();
+	sim_main_init();
+	hal_irq_enable();
+	sim_set_preempt(opt.preempt, opt.seed);
+
+	auto sample = [&r]() {
+		if (ps2d.input_queue.len > r.hwm_dev_in) r.hwm_dev_in = ps2d.input_queue.len;
+		if (ps2d.output_queue.len > r.hwm_dev_out) r.hwm_dev_out = ps2d.output_queue.len;
+		if (ps2h.input_queue.len > r.hwm_host_in) r.hwm_host_in = ps2h.input_queue.len;
+		if (ps2h.output_queue.len > r.hwm_host_out) r.hwm_host_out = ps2h.output_queue.len;
+	};
+	sim_on_isr(sample);
+
+	std::exponential_distribution<double> interval(noise / 1e6);
+	std::function<void()> glitch = [&]() {
+		sim_glitch(rng() & 1 ? SIM_KB_CLOCK : SIM_KB_DATA, 1);
+		sim_after(1 + (uint32_t)interval(rng), glitch);
+	};
+	if (noise) {
+		sim_after(1 + (uint32_t)interval(rng), glitch);
+	}
+
+	for (unsigned i = 0; i < opt.bytes; i++) {
+		kb.send(1 + i % 0x7f);	// never a response code
+	}
+
+	uint64_t next_cmd = opt.cmd_ms ? opt.cmd_ms * 1000 : UINT64_MAX;
+	uint64_t next_inhibit = opt.inhibit_ms ? opt.inhibit_ms * 1000 : UINT64_MAX;
+	uint64_t limit = (uint64_t)opt.bytes * 5000 + 100000;
+	unsigned idle_steps = 0;
+	while (sim_now() < limit) {
+		uint64_t now = sim_now();
+		if (now >= next_cmd) {
+			pc.send(0xed);
+			pc.send(rng() & 7);
+			next_cmd = now + opt.cmd_ms * 1000;
+		}
+		if (now >= next_inhibit) {
+			pc.hold(100 + rng() % 2000);
+			next_inhibit = now + opt.inhibit_ms * 1000;
+		}
+
+		sim_main_pass(opt.run_us);
+		sample();
+
+		bool busy = !kb.idle() || !pc.idle() || ps2d.input_queue.len || ps2h.output_queue.len || ps2d.output_queue.len || ps2h.input_queue.len;
+		if (kb.sent >= opt.bytes && !busy) {
+			if (++idle_steps > 1000) break;
+		} else {
+			idle_steps = 0;
+		}
+	}
+	r.elapsed = sim_now();
+
+	// match what the PC got against what the keyboard sent, in order; a
+	// byte the keyboard did not send by then is a corrupted frame that
+	// got through
+	size_t i = 0;
+	uint64_t total = 0;
+	for (size_t j = 0; j < pc.received.size(); j++) {
+		size_t k = i;
+		while (k < kb.sent_bytes.size() && kb.sent_at[k] <= pc.received_at[j] && kb.sent_bytes[k] != pc.received[j]) {
+			k++;
+		}
+		if (k == kb.sent_bytes.size() || kb.sent_at[k] > pc.received_at[j]) {
+			r.corrupted++;
+			continue;
+		}
+		r.up_dropped += k - i;
+		uint64_t latency = pc.received_at[j] - kb.sent_at[k];
+		total += latency;
+		if (latency > r.latency_max) r.latency_max = latency;
+		i = k + 1;
+	}
+	r.up_dropped += kb.sent_bytes.size() - i;
+	r.kb_sent = kb.sent_bytes.size();
+	r.pc_received = pc.received.size();
+	r.latency_avg = pc.received.empty() ? 0 : (double)total / pc.received.size();
+	r.down_sent = pc.sent;
+	r.down_dropped = pc.sent > kb.received.size() ? pc.sent - kb.received.size() : 0;
+	r.errors = ps2d.errors;
+	for (uint8_t t = 0; t < SCHED_TASKS; t++) {
+		if (sched_stats[t].late_max > r.task_late) r.task_late = sched_stats[t].late_max;
+	}
+	sim_reset();	// drop the pending glitch events, they refer to this frame
+	return r;
+}
+
+int main(int argc, char **argv)
+{
+	Options opt;
+	int c;
+	while ((c = getopt(argc, argv, "r:n:g:c:i:p:l:z:s:")) != -1) {
+		unsigned v = strtoul(optarg, nullptr, 0);
+		switch (c) {
+		case 'r': opt.rate = v; break;
+		case 'n': opt.bytes = v; break;
+		case 'g': opt.gap = v; break;
+		case 'c': opt.cmd_ms = v; break;
+		case 'i': opt.inhibit_ms = v; break;
+		case 'p': opt.preempt = v; break;
+		case 'l': opt.run_us = v; break;
+		case 'z': opt.noise = v; break;
+		case 's': opt.seed = v; break;
+		default:
+			fprintf(stderr, "usage: %s [-r hz] [-n bytes] [-g gap_us] [-c cmd_ms] [-i inhibit_ms] [-p preempt_us] [-l run_us] [-z glitches_per_s] [-s seed]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	std::vector<std::pair<unsigned, unsigned>> points;	// rate, noise
+	if (opt.noise) {
+		unsigned rate = opt.rate ? opt.rate : 12500;
+		for (unsigned k : { 0, 1, 2, 4 }) {
+			points.emplace_back(rate, opt.noise * k / 4);
+		}
+	} else if (opt.rate) {
+		points.emplace_back(opt.rate, 0);
+	} else {
+		for (unsigned rate : { 10000, 12500, 14286, 16667 }) {
+			points.emplace_back(rate, 0);
+		}
+	}
+
+	if (opt.noise) printf("noise/s ");
+	printf("   rate   kb->pc  dropped  pc->kb  dropped  q(dev in/out host in/out)  latency avg/max us  task late us");
+	if (opt.noise) printf("  errors  bad");
+	printf("\n");
+	bool lossless = true;
+	for (auto const &p : points) {
+		Result r = run(opt, p.first, p.second);
+		if (opt.noise) printf("%7u ", p.second);
+		printf("%7u  %7lu  %7lu  %6lu  %7lu  %6u %3u %7u %3u  %12.0f %7lu  %12u",
+			p.first, r.kb_sent, r.up_dropped, r.down_sent, r.down_dropped,
+			r.hwm_dev_in, r.hwm_dev_out, r.hwm_host_in, r.hwm_host_out,
+			r.latency_avg, (unsigned long)r.latency_max, r.task_late);
+		if (opt.noise) printf("  %6lu %4lu", r.errors, r.corrupted);
+		printf("\n");
+		if (r.up_dropped || r.down_dropped || r.corrupted) lossless = false;
+	}
+	return lossless ? 0 : 1;
+}
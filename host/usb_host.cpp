@@ -0,0 +1,48 @@
+
+#include "usb.h"
+#include "usb_host.h"
+
+std::string usb_host_output;
+std::string usb_host_input;
+bool usb_host_busy = false;
+
+void usb_init()
+{
+	clear_buffers();
+}
+
+uint8_t is_usb_configured()
+{
+	return 1;
+}
+
+uint8_t usb_data_tx(const uint8_t *ptr, uint8_t len)
+{
+	usb_host_output.append((char const *)ptr, len);
+	return len;
+}
+
+uint8_t usb_data_tx_ready()
+{
+	return !usb_host_busy;
+}
+
+uint8_t usb_data_rx(uint8_t *ptr, uint8_t len)
+{
+	uint8_t n = usb_host_input.size() < len ? usb_host_input.size() : len;
+	usb_host_input.copy((char *)ptr, n);
+	usb_host_input.erase(0, n);
+	return n;
+}
+
+uint8_t usb_read_available_()
+{
+	return usb_host_input.size() < RX_EP_SIZE ? usb_host_input.size() : RX_EP_SIZE;
+}
+
+uint8_t usb_read_byte_()
+{
+	uint8_t c = 0;
+	usb_data_rx(&c, 1);
+	return c;
+}
@@ -0,0 +1,13 @@
+#ifndef USB_HOST_H
+#define USB_HOST_H
+
+#include <stdint.h>
+#include <string>
+
+// CDC byte sink of the host build
+
+extern std::string usb_host_output;	// everything written to the IN endpoint
+extern std::string usb_host_input;	// pending bytes for the OUT endpoint
+extern bool usb_host_busy;	// the IN endpoint is not ready, nobody reads
+
+#endif // USB_HOST_H
@@ -0,0 +1,556 @@
+
+#include "usb_mock.h"
+#include "hal.h"
+#include <avr/io.h>
+#include <deque>
+#include <string.h>
+
+extern "C" void USB_GEN_vect();
+extern "C" void USB_COM_vect();
+
+MockReg UENUM(MOCK_UENUM);
+MockReg UEINTX(MOCK_UEINTX);
+MockReg UEDATX(MOCK_UEDATX);
+MockReg UEBCLX(MOCK_UEBCLX);
+MockReg UECONX(MOCK_UECONX);
+MockReg UECFG0X(MOCK_UECFG0X);
+MockReg UECFG1X(MOCK_UECFG1X);
+MockReg UEIENX(MOCK_UEIENX);
+MockReg UERST(MOCK_UERST);
+MockReg UDINT(MOCK_UDINT);
+MockReg UDIEN(MOCK_UDIEN);
+MockReg UDCON(MOCK_UDCON);
+MockReg UDADDR(MOCK_UDADDR);
+MockReg UDFNUML(MOCK_UDFNUML);
+MockReg USBCON(MOCK_USBCON);
+MockReg PLLCSR(MOCK_PLLCSR);
+MockReg REGCR(MOCK_REGCR);
+MockReg SREG(MOCK_SREG);
+
+UsbMockStats usb_mock_stats;
+std::string usb_mock_in[USB_MOCK_ENDPOINTS];
+
+struct Endpoint {
+	bool enabled;
+	bool stall;
+	uint8_t cfg0;
+	uint8_t cfg1;
+	uint8_t ienx;
+	uint8_t flags;	// RXSTPI, RXOUTI, TXINI of the control endpoint
+	std::deque<std::string> banks;	// IN: handed to the host, OUT: owned by the cpu
+	std::string cur;	// bank being written by the cpu
+	std::string rx;	// control endpoint: SETUP or OUT data being read
+	size_t rd;
+};
+
+// control transfer in progress on endpoint 0
+struct Control {
+	bool in;
+	bool done;
+	uint16_t length;
+	std::string data;
+};
+
+static Endpoint ep[USB_MOCK_ENDPOINTS];
+static Control ctl;
+static uint8_t regs[MOCK_REGS];
+static bool irq_enabled;
+static unsigned irq_off_run;
+static unsigned preempt_every;
+static unsigned preempt_count;
+static int depth;
+static unsigned long frame;
+
+static Endpoint &cur_ep()
+{
+	return ep[regs[MOCK_UENUM] % USB_MOCK_ENDPOINTS];
+}
+
+static bool is_control(Endpoint const &e)
+{
+	return (e.cfg0 & 0xc0) == 0;
+}
+
+static bool is_in(Endpoint const &e)
+{
+	return e.cfg0 & 0x01;
+}
+
+static size_t ep_size(Endpoint const &e)
+{
+	return 8 << ((e.cfg1 >> 4) & 7);
+}
+
+static size_t ep_banks(Endpoint const &e)
+{
+	return (e.cfg1 & 0x0c) ? 2 : 1;
+}
+
+static void ep_flush(Endpoint &e)
+{
+	e.banks.clear();
+	e.cur.clear();
+	e.rx.clear();
+	e.rd = 0;
+}
+
+// bank of an IN endpoint free for the cpu
+static bool cpu_bank(Endpoint const &e)
+{
+	return e.banks.size() < ep_banks(e);
+}
+
+static size_t out_remaining(Endpoint const &e)
+{
+	return e.banks.empty() ? 0 : e.banks.front().size() - e.rd;
+}
+
+static bool com_pending()
+{
+	Endpoint const &e = ep[0];
+	return e.enabled && (e.ienx & (1 << RXSTPE)) && (e.flags & (1 << RXSTPI));
+}
+
+// register accesses while interrupts are off, a measure of how long a
+// PS/2 clock edge may wait
+static void irq_off_access()
+{
+	if (!irq_enabled && ++irq_off_run > usb_mock_stats.irq_off_max) {
+		usb_mock_stats.irq_off_max = irq_off_run;
+	}
+}
+
+static void dispatch();
+
+// extra SOF interrupts in the middle of the firmware's register accesses
+static void preempt()
+{
+	if (preempt_every == 0 || !irq_enabled || depth > 0) return;
+	if (++preempt_count < preempt_every) return;
+	preempt_count = 0;
+	regs[MOCK_UDINT] |= 1 << SOFI;
+	dispatch();
+}
+
+void usb_mock_set_preempt(unsigned every)
+{
+	preempt_every = every;
+	preempt_count = 0;
+}
+
+static void set_irq(bool enabled)
+{
+	irq_enabled = enabled;
+	if (enabled) irq_off_run = 0;
+}
+
+static void dispatch()
+{
+	for (int guard = 0; guard < 16; guard++) {
+		if (!irq_enabled || depth > 4) return;
+		void (*vector)();
+		if (regs[MOCK_UDINT] & regs[MOCK_UDIEN]) {
+			vector = USB_GEN_vect;
+		} else if (com_pending()) {
+			vector = USB_COM_vect;
+		} else {
+			return;
+		}
+		set_irq(false);	// cleared on entry, set again by reti
+		depth++;
+		vector();
+		depth--;
+		set_irq(true);
+	}
+}
+
+void usb_mock_cli()
+{
+	set_irq(false);
+}
+
+void usb_mock_sei()
+{
+	set_irq(true);
+	dispatch();
+}
+
+// hal.h critical sections of usb.c map onto the same I flag
+
+void hal_irq_disable()
+{
+	usb_mock_cli();
+}
+
+void hal_irq_enable()
+{
+	usb_mock_sei();
+}
+
+uint8_t hal_irq_save()
+{
+	uint8_t state = irq_enabled;
+	set_irq(false);
+	return state;
+}
+
+void hal_irq_restore(uint8_t state)
+{
+	if (state) {
+		usb_mock_sei();
+	} else {
+		usb_mock_cli();
+	}
+}
+
+// the start of frame posts the USB tasks, there is no scheduler here
+
+extern "C" void sched_post(uint8_t)
+{
+}
+
+// endpoint 0: the firmware answers SETUP packets by clearing flags
+
+static void control_write_ueintx(Endpoint &e, uint8_t v)
+{
+	uint8_t cleared = e.flags & ~v;
+	if (cleared & (1 << RXSTPI)) {
+		e.flags = 0;
+		e.rx.clear();
+		e.rd = 0;
+		if (ctl.in || ctl.length == 0) {
+			e.flags |= 1 << TXINI;	// host sends IN tokens
+		} else {
+			e.rx = ctl.data;	// OUT data stage
+			e.flags |= 1 << RXOUTI;
+		}
+		return;
+	}
+	if (cleared & (1 << RXOUTI)) {
+		e.flags &= ~(1 << RXOUTI);
+		e.rx.clear();
+		e.rd = 0;
+		e.flags |= 1 << TXINI;	// IN token of the status stage
+	}
+	if (cleared & (1 << TXINI)) {
+		e.flags &= ~(1 << TXINI);
+		std::string packet;
+		packet.swap(e.cur);
+		if (ctl.in && !ctl.done) {
+			ctl.data += packet;
+			if (packet.size() < ep_size(e) || ctl.data.size() >= ctl.length) {
+				ctl.done = true;
+				e.flags |= 1 << RXOUTI;	// host moves on to the status stage
+				return;
+			}
+		} else {
+			ctl.done = true;	// zero length status packet
+		}
+		e.flags |= 1 << TXINI;
+	}
+}
+
+static uint8_t read_ueintx()
+{
+	Endpoint &e = cur_ep();
+	if (is_control(e)) {
+		uint8_t v = e.flags;
+		if (e.cur.size() < ep_size(e)) v |= 1 << RWAL;
+		return v;
+	}
+	uint8_t v = 0;
+	if (is_in(e)) {
+		if (cpu_bank(e)) {
+			v |= 1 << FIFOCON;
+			if (e.cur.empty()) v |= 1 << TXINI;
+			if (e.cur.size() < ep_size(e)) v |= 1 << RWAL;
+		}
+	} else {
+		if (!e.banks.empty()) {
+			v |= (1 << FIFOCON) | (1 << RXOUTI);
+			if (out_remaining(e) > 0) v |= 1 << RWAL;
+		}
+	}
+	return v;
+}
+
+static void write_ueintx(uint8_t v)
+{
+	Endpoint &e = cur_ep();
+	if (is_control(e)) {
+		control_write_ueintx(e, v);
+		return;
+	}
+	if (v & (1 << FIFOCON)) return;
+	if (is_in(e)) {
+		if (!cpu_bank(e)) {
+			usb_mock_stats.bad_releases++;
+			return;
+		}
+		e.banks.push_back(e.cur);
+		e.cur.clear();
+	} else {
+		if (e.banks.empty()) {
+			usb_mock_stats.bad_releases++;
+			return;
+		}
+		e.banks.pop_front();
+		e.rd = 0;
+	}
+}
+
+static uint8_t read_uedatx()
+{
+	Endpoint &e = cur_ep();
+	if (is_control(e)) {
+		if (e.rd < e.rx.size()) return e.rx[e.rd++];
+	} else if (out_remaining(e) > 0) {
+		return e.banks.front()[e.rd++];
+	}
+	usb_mock_stats.underruns++;
+	return 0;
+}
+
+static void write_uedatx(uint8_t v)
+{
+	Endpoint &e = cur_ep();
+	if ((is_control(e) || cpu_bank(e)) && e.cur.size() < ep_size(e)) {
+		e.cur += (char)v;
+	} else {
+		usb_mock_stats.overruns++;
+	}
+}
+
+static uint8_t read_uebclx()
+{
+	Endpoint &e = cur_ep();
+	if (is_control(e)) return e.rx.size() - e.rd;
+	return is_in(e) ? e.cur.size() : out_remaining(e);
+}
+
+MockReg::operator uint8_t() const
+{
+	if (id != MOCK_SREG) {
+		preempt();
+		irq_off_access();
+	}
+	switch (id) {
+	case MOCK_UEINTX:
+		return read_ueintx();
+	case MOCK_UEDATX:
+		return read_uedatx();
+	case MOCK_UEBCLX:
+		return read_uebclx();
+	case MOCK_UECONX: {
+		Endpoint &e = cur_ep();
+		return (e.enabled ? 1 << EPEN : 0) | (e.stall ? 1 << STALLRQ : 0);
+	}
+	case MOCK_UECFG0X:
+		return cur_ep().cfg0;
+	case MOCK_UECFG1X:
+		return cur_ep().cfg1;
+	case MOCK_UEIENX:
+		return cur_ep().ienx;
+	case MOCK_UDFNUML:
+		return frame & 0xff;
+	case MOCK_PLLCSR:
+		return regs[id] | (1 << PLOCK);
+	case MOCK_SREG:
+		return irq_enabled ? 0x80 : 0;
+	}
+	return regs[id];
+}
+
+MockReg &MockReg::operator=(int v)
+{
+	uint8_t b = v;
+	if (id != MOCK_SREG) {
+		preempt();
+		irq_off_access();
+	}
+	switch (id) {
+	case MOCK_UEINTX:
+		write_ueintx(b);
+		return *this;
+	case MOCK_UEDATX:
+		write_uedatx(b);
+		return *this;
+	case MOCK_UECONX: {
+		Endpoint &e = cur_ep();
+		e.enabled = b & (1 << EPEN);
+		if (b & (1 << STALLRQ)) e.stall = true;
+		if (b & (1 << STALLRQC)) e.stall = false;
+		if (!e.enabled) ep_flush(e);
+		return *this;
+	}
+	case MOCK_UECFG0X:
+		cur_ep().cfg0 = b;
+		return *this;
+	case MOCK_UECFG1X:
+		cur_ep().cfg1 = b;
+		return *this;
+	case MOCK_UEIENX:
+		cur_ep().ienx = b;
+		break;
+	case MOCK_UERST:
+		for (int i = 0; i < USB_MOCK_ENDPOINTS; i++) {
+			if (b & (1 << i)) ep_flush(ep[i]);
+		}
+		break;
+	case MOCK_UDINT:
+		regs[id] &= b;	// flags are cleared by writing 0
+		return *this;
+	case MOCK_SREG:
+		if (b & 0x80) {
+			usb_mock_sei();
+		} else {
+			usb_mock_cli();
+		}
+		return *this;
+	}
+	regs[id] = b;
+	if (id == MOCK_UDIEN || id == MOCK_UEIENX) dispatch();
+	return *this;
+}
+
+// host side
+
+void usb_mock_reset()
+{
+	for (Endpoint &e : ep) {
+		e = Endpoint();
+	}
+	for (std::string &s : usb_mock_in) {
+		s.clear();
+	}
+	ctl = Control();
+	memset(regs, 0, sizeof(regs));
+	memset(&usb_mock_stats, 0, sizeof(usb_mock_stats));
+	irq_enabled = false;
+	irq_off_run = 0;
+	depth = 0;
+	frame = 0;
+}
+
+void usb_mock_bus_reset()
+{
+	for (Endpoint &e : ep) {
+		e = Endpoint();
+	}
+	regs[MOCK_UDADDR] = 0;
+	regs[MOCK_UDINT] |= 1 << EORSTI;
+	dispatch();
+}
+
+uint8_t usb_mock_address()
+{
+	uint8_t a = regs[MOCK_UDADDR];
+	return (a & (1 << ADDEN)) ? a & 0x7f : 0;
+}
+
+unsigned usb_mock_dpram_used()
+{
+	unsigned n = 0;
+	for (Endpoint const &e : ep) {
+		if (e.enabled && (e.cfg1 & 0x02)) n += ep_size(e) * ep_banks(e);
+	}
+	return n;
+}
+
+// Runs a control transfer through USB_COM_vect; interrupts must be enabled.
+// Returns the length of the data stage, or -1 if the request was stalled.
+int usb_mock_control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, std::string *data, uint16_t wLength)
+{
+	Endpoint &e = ep[0];
+	if (!e.enabled) return -1;
+	ctl = Control();
+	ctl.in = bmRequestType & 0x80;
+	ctl.length = ctl.in ? wLength : data->size();
+	if (!ctl.in) ctl.data = *data;
+	uint8_t setup[8] = {
+		bmRequestType, bRequest,
+		uint8_t(wValue), uint8_t(wValue >> 8),
+		uint8_t(wIndex), uint8_t(wIndex >> 8),
+		uint8_t(ctl.length), uint8_t(ctl.length >> 8),
+	};
+	ep_flush(e);
+	e.stall = false;
+	e.rx.assign((char const *)setup, sizeof(setup));
+	e.flags = 1 << RXSTPI;
+	dispatch();
+	if (e.stall) {
+		usb_mock_stats.stalls++;
+		e.stall = false;
+		return -1;
+	}
+	if (ctl.in) {
+		*data = ctl.data;
+		return ctl.data.size();
+	}
+	return ctl.length;
+}
+
+// OUT packet from the host; false if NAKed because no bank is free
+bool usb_mock_out(uint8_t n, uint8_t const *ptr, uint8_t len)
+{
+	Endpoint &e = ep[n];
+	if (!e.enabled || e.stall || is_in(e) || len > ep_size(e)) return false;
+	if (e.banks.size() >= ep_banks(e)) {
+		usb_mock_stats.out_naks++;
+		return false;
+	}
+	e.banks.push_back(std::string((char const *)ptr, len));
+	usb_mock_stats.out_packets++;
+	return true;
+}
+
+// bytes of an IN endpoint the host has not taken yet
+unsigned usb_mock_in_pending(uint8_t n)
+{
+	Endpoint const &e = ep[n];
+	unsigned bytes = e.cur.size();
+	for (std::string const &b : e.banks) {
+		bytes += b.size();
+	}
+	return bytes;
+}
+
+static void in_tokens(Endpoint &e, int n, unsigned tokens)
+{
+	for (unsigned t = 0; t < tokens; t++) {
+		if (e.banks.empty()) {
+			usb_mock_stats.in_naks++;
+			break;
+		}
+		std::string const &packet = e.banks.front();
+		usb_mock_in[n] += packet;
+		usb_mock_stats.in_packets++;
+		usb_mock_stats.in_bytes += packet.size();
+		e.banks.pop_front();
+	}
+}
+
+// up to n IN tokens to every bulk IN endpoint
+void usb_mock_in_tokens(unsigned n)
+{
+	for (int i = 1; i < USB_MOCK_ENDPOINTS; i++) {
+		Endpoint &e = ep[i];
+		if (!e.enabled || e.stall || !is_in(e) || (e.cfg0 & 0xc0) != 0x80) continue;
+		in_tokens(e, i, n);
+	}
+}
+
+// start of a 1 ms frame: SOF interrupt, then one IN token to every
+// interrupt IN endpoint
+void usb_mock_frame()
+{
+	frame++;
+	usb_mock_stats.frames++;
+	regs[MOCK_UDINT] |= 1 << SOFI;
+	dispatch();
+	for (int i = 1; i < USB_MOCK_ENDPOINTS; i++) {
+		Endpoint &e = ep[i];
+		if (!e.enabled || e.stall || !is_in(e) || (e.cfg0 & 0xc0) != 0xc0) continue;
+		in_tokens(e, i, 1);
+	}
+}
@@ -0,0 +1,99 @@
+#ifndef USB_MOCK_H
+#define USB_MOCK_H
+
+#include <stdint.h>
+#include <string>
+
+// register level model of the ATmega32U2 USB device controller
+//
+// usb.c is compiled as is against host/avr/*.h, where every USB register
+// is a MockReg forwarding reads and writes to this model. Each endpoint
+// keeps a FIFO of banks; RWAL, FIFOCON, TXINI and RXOUTI are derived from
+// the bank state like on the chip. The host side below plays the USB host
+// controller: control transfers on endpoint 0, OUT packets, IN tokens and
+// the SOF of every frame. USB_GEN_vect and USB_COM_vect are
+// raised through the modelled I flag of SREG.
+
+enum {
+	MOCK_UENUM,
+	MOCK_UEINTX,
+	MOCK_UEDATX,
+	MOCK_UEBCLX,
+	MOCK_UECONX,
+	MOCK_UECFG0X,
+	MOCK_UECFG1X,
+	MOCK_UEIENX,
+	MOCK_UERST,
+	MOCK_UDINT,
+	MOCK_UDIEN,
+	MOCK_UDCON,
+	MOCK_UDADDR,
+	MOCK_UDFNUML,
+	MOCK_USBCON,
+	MOCK_PLLCSR,
+	MOCK_REGCR,
+	MOCK_SREG,
+	MOCK_REGS,
+};
+
+class MockReg {
+private:
+	uint8_t id;
+public:
+	explicit MockReg(uint8_t id)
+		: id(id)
+	{
+	}
+	MockReg(MockReg const &) = delete;
+	MockReg &operator=(MockReg const &) = delete;
+	operator uint8_t() const;
+	MockReg &operator=(int v);
+	MockReg &operator|=(int v)
+	{
+		return *this = *this | v;
+	}
+	MockReg &operator&=(int v)
+	{
+		return *this = *this & v;
+	}
+};
+
+void usb_mock_cli();
+void usb_mock_sei();
+
+// host side
+
+#define USB_MOCK_ENDPOINTS 5
+#define USB_MOCK_DPRAM 176	// bytes of endpoint bank memory
+
+struct UsbMockStats {
+	unsigned long frames;
+	unsigned long in_packets;	// IN packets taken by the host
+	unsigned long in_bytes;
+	unsigned long in_naks;		// IN tokens with no bank ready
+	unsigned long out_packets;
+	unsigned long out_naks;		// OUT packets refused, no free bank
+	unsigned long overruns;		// UEDATX writes with RWAL clear, lost
+	unsigned long underruns;	// UEDATX reads from an empty bank
+	unsigned long bad_releases;	// FIFOCON cleared without a bank
+	unsigned long stalls;
+	unsigned long irq_off_max;	// longest run of register accesses with interrupts off
+};
+
+extern UsbMockStats usb_mock_stats;
+extern std::string usb_mock_in[USB_MOCK_ENDPOINTS];	// data received per IN endpoint
+
+void usb_mock_reset();
+void usb_mock_bus_reset();
+int usb_mock_control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, std::string *data, uint16_t wLength);
+bool usb_mock_out(uint8_t ep, uint8_t const *ptr, uint8_t len);
+void usb_mock_frame();
+void usb_mock_in_tokens(unsigned n);
+unsigned usb_mock_in_pending(uint8_t ep);
+uint8_t usb_mock_address();
+unsigned usb_mock_dpram_used();
+
+// raise SOF every n register accesses made with interrupts enabled, 0 = off
+void usb_mock_set_preempt(unsigned every);
+
+#endif // USB_MOCK_H
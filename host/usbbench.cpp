@@ -0,0 +1,309 @@
+
+// CDC throughput bench of usb.c on the mocked USB controller
+//
+// usb.c and the cdc.cpp rings run against host/usb_mock.cpp. After
+// checking enumeration, the firmware side writes log lines at a given rate
+// while the host takes a limited number of IN packets per frame and
+// streams bytes to the OUT endpoint. Reports bytes delivered per frame and
+// every byte that got lost without being counted in data_tx_dropped.
+//
+//  ps2sniffer-usb [-f frames] [-w bytes_per_frame] [-k in_packets_per_frame]
+//                 [-l loops_per_frame] [-o out_bytes_per_frame]
+//                 [-s stall_frames] [-p preempt_every] [-r]
+//
+// -r writes every line as one record through usb_tx_reserve() and
+// usb_tx_commit(), with line lengths from 17 to 39 bytes, and checks that
+// only whole lines arrive. -p raises an extra SOF interrupt every n register accesses the firmware
+// makes with interrupts enabled, in the middle of its endpoint accesses.
+// Without -w and -k a grid of write rates and host read rates is swept.
+
+#include "cdc.h"
+#include "usb.h"
+#include "usb_mock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#define DATA_IN_ENDPOINT 3
+#define DATA_OUT_ENDPOINT 2
+
+extern uint8_t data_tx_buffer_n;
+
+struct Options {
+	unsigned frames = 2000;
+	unsigned write = 0;
+	unsigned tokens = 0;
+	unsigned loops = 4;
+	unsigned out = 64;
+	unsigned stall = 0;
+	unsigned preempt = 0;
+	bool records = false;
+};
+
+struct Result {
+	unsigned long written = 0;
+	unsigned long delivered = 0;
+	unsigned long counted = 0;	// data_tx_dropped
+	unsigned long silent = 0;
+	unsigned max_frame = 0;
+	bool ordered = true;
+	unsigned long out_sent = 0;
+	unsigned long out_received = 0;
+	bool out_ok = true;
+	bool whole = true;	// -r: no partial line delivered
+};
+
+static int failures;
+static UsbMockStats totals;	// controller errors over all runs
+
+static void expect(bool ok, char const *what)
+{
+	if (!ok) {
+		printf("FAIL: %s\n", what);
+		failures++;
+	}
+}
+
+static int get_descriptor(uint16_t wValue, uint16_t wIndex, uint16_t wLength, std::string *data)
+{
+	return usb_mock_control(0x80, 6, wValue, wIndex, data, wLength);
+}
+
+// control request without data stage
+static int request(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex)
+{
+	std::string none;
+	return usb_mock_control(bmRequestType, bRequest, wValue, wIndex, &none, 0);
+}
+
+static void attach()
+{
+	usb_mock_reset();
+	usb_init();
+	usb_mock_bus_reset();
+}
+
+static void enumerate()
+{
+	request(0x00, 5, 7, 0); // SET_ADDRESS
+	request(0x00, 9, 1, 0); // SET_CONFIGURATION
+	std::string d("\x00\xc2\x01\x00\x00\x00\x08", 7); // 115200 8N1
+	usb_mock_control(0x21, 0x20, 0, 0, &d, 0); // CDC_SET_LINE_CODING
+	request(0x21, 0x22, 3, 0); // CDC_SET_CONTROL_LINE_STATE, DTR and RTS
+}
+
+static void check_enumeration()
+{
+	std::string d;
+	attach();
+	expect(!is_usb_configured(), "configured before SET_CONFIGURATION");
+	expect(get_descriptor(0x0100, 0, 64, &d) == 18 && (uint8_t)d[0] == 18 && d[1] == 1, "device descriptor");
+	expect(get_descriptor(0x0200, 0, 9, &d) == 9 && d[1] == 2, "configuration descriptor header");
+	uint16_t total = (uint8_t)d[2] | ((uint8_t)d[3] << 8);
+	expect(get_descriptor(0x0200, 0, total, &d) == total, "configuration descriptor");
+	expect(get_descriptor(0x0301, 0x0409, 255, &d) > 2 && (uint8_t)d[0] == d.size() && d[1] == 3, "string descriptor");
+	expect(get_descriptor(0x0600, 0, 10, &d) < 0, "unknown descriptor not stalled");
+	expect(request(0x00, 5, 7, 0) == 0 && usb_mock_address() == 7, "SET_ADDRESS");
+	expect(request(0x00, 9, 1, 0) == 0 && is_usb_configured(), "SET_CONFIGURATION");
+	expect(usb_mock_control(0x80, 8, 0, 0, &d, 1) == 1 && d[0] == 1, "GET_CONFIGURATION");
+	std::string line("\x00\xc2\x01\x00\x00\x00\x08", 7);
+	d = line;
+	expect(usb_mock_control(0x21, 0x20, 0, 0, &d, 0) == 7, "CDC_SET_LINE_CODING");
+	expect(usb_mock_control(0xa1, 0x21, 0, 0, &d, 7) == 7 && d == line, "CDC_GET_LINE_CODING");
+	expect(request(0x21, 0x22, 3, 0) == 0, "CDC_SET_CONTROL_LINE_STATE");
+	expect(usb_mock_dpram_used() <= USB_MOCK_DPRAM, "endpoint banks exceed the DPRAM");
+	printf("enumeration: %s, address %u, DPRAM %u/%u bytes, %lu stalls, interrupts off for %lu register accesses max\n",
+		failures ? "FAILED" : "ok", usb_mock_address(), usb_mock_dpram_used(), USB_MOCK_DPRAM, usb_mock_stats.stalls,
+		usb_mock_stats.irq_off_max);
+}
+
+// true if every byte of a shows up in b in order
+static bool subsequence(std::string const &a, std::string const &b)
+{
+	size_t j = 0;
+	for (char c : a) {
+		while (j < b.size() && b[j] != c) j++;
+		if (j == b.size()) return false;
+		j++;
+	}
+	return true;
+}
+
+static Result run(Options const &opt, unsigned write, unsigned tokens)
+{
+	Result r;
+	attach();
+	enumerate();
+	usb_mock_set_preempt(opt.preempt);
+	data_tx_dropped = 0;
+
+	std::string written;
+	std::string pending;
+	std::string out_sent;
+	std::string out_pending;
+	std::string out_received;
+	unsigned long seq = 0;
+	unsigned long out_seq = 0;
+	unsigned credit = 0;
+	unsigned token_credit = 0;
+	uint16_t dropped = 0;
+	unsigned drain = 0;
+	for (unsigned f = 0; f < opt.frames + drain; f++) {
+		bool producing = f < opt.frames;
+		bool stalled = opt.stall && producing && f % 500 >= 500 - opt.stall;
+		size_t before = usb_mock_in[DATA_IN_ENDPOINT].size();
+		usb_mock_frame();
+		if (producing) {
+			while (out_pending.size() < opt.out) {
+				out_pending += (char)(out_seq++ * 7);
+			}
+		}
+		for (unsigned l = 0; l < opt.loops; l++) {
+			if (producing) {
+				credit += write;
+				unsigned n = credit / opt.loops;
+				credit -= n * opt.loops;
+				while (n > 0) {
+					if (pending.empty()) {
+						char tmp[48];
+						unsigned pad = opt.records ? seq % 23 : 0;
+						sprintf(tmp, "H    <- %06lx D%*s\r\n", seq++ & 0xffffff, pad, "");
+						pending = tmp;
+					}
+					if (opt.records) {
+						if (n < pending.size()) {
+							credit += n * opt.loops;	// not enough for the line yet
+							break;
+						}
+						uint8_t *p = usb_tx_reserve(pending.size());
+						if (p) {
+							memcpy(p, pending.data(), pending.size());
+							usb_tx_commit(pending.size());
+							written += pending;
+						} else {
+							r.counted += pending.size();
+						}
+						n -= pending.size();
+						pending.clear();
+						continue;
+					}
+					usb_write_byte(pending[0]);
+					written += pending[0];
+					pending.erase(0, 1);
+					n--;
+				}
+			}
+			usb_poll();
+			while (usb_read_available() > 0) {
+				out_received += (char)usb_read_byte();
+			}
+			r.counted += (uint16_t)(data_tx_dropped - dropped);
+			dropped = data_tx_dropped;
+
+			// host side, IN and OUT transactions spread over the frame
+			token_credit += tokens;
+			unsigned t = token_credit / opt.loops;
+			token_credit -= t * opt.loops;
+			if (!stalled) usb_mock_in_tokens(t);
+			if (!out_pending.empty()) {
+				uint8_t len = out_pending.size() < RX_EP_SIZE ? out_pending.size() : RX_EP_SIZE;
+				if (usb_mock_out(DATA_OUT_ENDPOINT, (uint8_t const *)out_pending.data(), len)) {
+					out_sent.append(out_pending, 0, len);
+					out_pending.erase(0, len);
+				}
+			}
+		}
+		size_t n = usb_mock_in[DATA_IN_ENDPOINT].size() - before;
+		if (n > r.max_frame) r.max_frame = n;
+		bool busy = data_tx_buffer_n > 0 || usb_mock_in_pending(DATA_IN_ENDPOINT) > 0 || !out_pending.empty();
+		if (f + 1 == opt.frames + drain && drain < 1000 && busy) {
+			drain++;
+		}
+	}
+
+	std::string const &delivered = usb_mock_in[DATA_IN_ENDPOINT];
+	r.written = written.size();
+	r.delivered = delivered.size();
+	long lost = (long)r.written - (long)r.delivered - (long)r.counted - data_tx_buffer_n - usb_mock_in_pending(DATA_IN_ENDPOINT);
+	r.silent = lost > 0 ? lost : 0;
+	r.ordered = subsequence(delivered, written);
+	if (opt.records) {
+		for (size_t i = 0; i < delivered.size();) {
+			size_t e = delivered.find("\r\n", i);
+			if (e == std::string::npos || delivered.compare(i, 8, "H    <- ") != 0 || delivered[i + 15] != 'D') {
+				r.whole = false;
+				break;
+			}
+			i = e + 2;
+		}
+	}
+	r.out_sent = out_sent.size();
+	r.out_received = out_received.size();
+	r.out_ok = out_received == out_sent;
+	totals.overruns += usb_mock_stats.overruns;
+	totals.underruns += usb_mock_stats.underruns;
+	totals.bad_releases += usb_mock_stats.bad_releases;
+	if (usb_mock_stats.irq_off_max > totals.irq_off_max) {
+		totals.irq_off_max = usb_mock_stats.irq_off_max;
+	}
+	return r;
+}
+
+int main(int argc, char **argv)
+{
+	Options opt;
+	int c;
+	while ((c = getopt(argc, argv, "f:w:k:l:o:s:p:r")) != -1) {
+		unsigned v = optarg ? strtoul(optarg, nullptr, 0) : 0;
+		switch (c) {
+		case 'f': opt.frames = v; break;
+		case 'w': opt.write = v; break;
+		case 'k': opt.tokens = v; break;
+		case 'l': opt.loops = v ? v : 1; break;
+		case 'o': opt.out = v; break;
+		case 's': opt.stall = v < 500 ? v : 499; break;
+		case 'p': opt.preempt = v; break;
+		case 'r': opt.records = true; break;
+		default:
+			fprintf(stderr, "usage: %s [-f frames] [-w bytes_per_frame] [-k in_packets_per_frame] [-l loops_per_frame] [-o out_bytes_per_frame] [-s stall_frames] [-p preempt_every] [-r]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	check_enumeration();
+
+	std::vector<unsigned> writes;
+	std::vector<unsigned> tokens;
+	if (opt.write) {
+		writes.push_back(opt.write);
+	} else {
+		writes = { 16, 64, 128, 256 };
+	}
+	if (opt.tokens) {
+		tokens.push_back(opt.tokens);
+	} else {
+		tokens = { 1, 2, 8 };
+	}
+
+	printf("  write/ms  in/frame  written  delivered  B/frame avg/max  dropped  silent  order  out sent/recv\n");
+	bool lossless = true;
+	for (unsigned w : writes) {
+		for (unsigned k : tokens) {
+			Result r = run(opt, w, k);
+			printf("%10u  %8u  %7lu  %9lu  %9.1f %5u  %7lu  %6lu  %5s  %7lu %7lu%s\n",
+				w, k, r.written, r.delivered,
+				(double)r.delivered / usb_mock_stats.frames, r.max_frame,
+				r.counted, r.silent, r.ordered && r.whole ? "ok" : "BAD",
+				r.out_sent, r.out_received, r.out_ok ? "" : " BAD");
+			if (r.silent || !r.ordered || !r.whole || !r.out_ok) lossless = false;
+		}
+	}
+	printf("controller: %lu overruns, %lu underruns, %lu bad releases\n",
+		totals.overruns, totals.underruns, totals.bad_releases);
+	printf("interrupts off for %lu register accesses max\n", totals.irq_off_max);
+	if (totals.overruns || totals.underruns || totals.bad_releases) lossless = false;
+	return lossless && failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,7 @@
+#ifndef MOCK_UTIL_DELAY_H
+#define MOCK_UTIL_DELAY_H
+
+#define _delay_ms(ms) ((void)(ms))
+#define _delay_us(us) ((void)(us))
+
+#endif // MOCK_UTIL_DELAY_H
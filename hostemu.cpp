@@ -0,0 +1,151 @@
+#include "hostemu.h"
+
+#ifdef HOSTEMU_ENABLED
+
+#include "hal.h"
+#include "ps2if.h"
+#include "report.h"
+
+HostEmu hostemu;
+
+static const uint8_t script[] PROGMEM = {
+	0xff,		// reset
+	0xf0, 0x02,	// scan code set 2
+	0xf3, 0x20,	// typematic 500 ms, 30 cps
+};
+
+#define SCRIPT_LEN sizeof(script)
+
+void hostemu_init(HostEmu *h)
+{
+	h->active = 0;
+	h->report = 0;
+	stats_init(&h->bat, 0, 7);	// 128 ms buckets
+	stats_init(&h->ack, 0, 10);	// 1 ms buckets
+	stats_init(&h->clock, 800, 7);	// 8 us buckets from 50 us
+}
+
+void hostemu_start(HostEmu *h)
+{
+	stats_clear(&h->bat);
+	stats_clear(&h->ack);
+	stats_clear(&h->clock);
+	h->round = 0;
+	h->step = 0;
+	h->wait = 0;
+	h->timeouts = 0;
+	h->resends = 0;
+	h->errors = 0;
+	h->report = 0;
+	h->active = 1;
+}
+
+void hostemu_edge(HostEmu *h, PS2IF *dev)
+{
+	uint16_t t = hal_cycles();
+	if (!h->active) return;
+	if (dev->input_bits) {
+		stats_add(&h->clock, t - h->edge_at);
+	} else if (dev->output_bits == 1) {
+		h->sent_at = micros();	// ack bit, the command is through
+	} else if (!dev->output_bits) {
+		h->frame_at = micros();	// start bit of a keyboard frame
+	}
+	h->edge_at = t;
+}
+
+static uint32_t since(volatile uint32_t const *from, volatile uint32_t const *to)
+{
+	uint8_t sreg = hal_irq_save();
+	uint32_t d = *to - *from;
+	hal_irq_restore(sreg);
+	return d;
+}
+
+static bool hostemu_line(void *ctx, uint8_t i)
+{
+	HostEmu *h = (HostEmu *)ctx;
+	switch (i) {
+	case 0:
+		print("B bat ");
+		stats_print(&h->bat);
+		return true;
+	case 1:
+		print("B ack ");
+		stats_print(&h->ack);
+		return true;
+	case 2:
+		print("B clock ");
+		stats_print(&h->clock);
+		return true;
+	}
+	print("B timeouts ");
+	print_dec(h->timeouts);
+	print(" resends ");
+	print_dec(h->resends);
+	print(" errors ");
+	print_dec(h->errors);
+	return false;
+}
+
+static void hostemu_next(HostEmu *h)
+{
+	h->wait = 0;
+	if (++h->step < SCRIPT_LEN) return;
+	h->step = 0;
+	if (++h->round < HOSTEMU_ROUNDS) return;
+	h->active = 0;
+	h->report = 1;
+}
+
+bool hostemu_device_byte(HostEmu *h, uint8_t c)
+{
+	if (!h->active) return false;
+	if (!h->wait) return true;	// stray, e.g. a key pressed meanwhile
+	uint32_t d = since(&h->sent_at, &h->frame_at);
+	if (h->wait == 0xfa) {
+		if (c == 0xfe) {
+			h->resends++;
+			h->wait = 0;	// the same command again
+			return true;
+		}
+		if (c != 0xfa) {
+			h->errors++;
+			hostemu_next(h);
+			return true;
+		}
+		stats_add(&h->ack, d > 0xffff ? 0xffff : d);
+		if (pgm_read_byte(script + h->step) == 0xff) {
+			h->reset_at = h->sent_at;
+			h->wait = 0xaa;
+			h->deadline = micros() + HOSTEMU_BAT_TIMEOUT;
+			return true;
+		}
+		hostemu_next(h);
+		return true;
+	}
+	if (c == 0xaa) {
+		stats_add(&h->bat, (h->frame_at - h->reset_at) / 1000);
+	} else {
+		h->errors++;	// FC, BAT failed
+	}
+	hostemu_next(h);
+	return true;
+}
+
+void hostemu_poll(HostEmu *h)
+{
+	report_lines(&h->report, hostemu_line, h);
+	if (!h->active) return;
+	if (h->wait) {
+		if ((int32_t)(micros() - h->deadline) < 0) return;
+		h->timeouts++;
+		hostemu_next(h);
+		if (!h->active) return;
+	}
+	kb_put(&ps2d, pgm_read_byte(script + h->step));
+	h->wait = 0xfa;
+	h->deadline = micros() + HOSTEMU_TIMEOUT;
+}
+
+#endif // HOSTEMU_ENABLED
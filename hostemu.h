@@ -0,0 +1,62 @@
+#ifndef HOSTEMU_H
+#define HOSTEMU_H
+
+#include <stdint.h>
+#include "stats.h"
+
+//#define HOSTEMU_ENABLED
+
+#ifdef HOSTEMU_ENABLED
+
+struct PS2IF;
+
+// keyboard benchmark, the firmware as the PS/2 host of the keyboard
+//
+// For an empty PC port. The 'B' command runs HOSTEMU_ROUNDS rounds of
+// reset (FF), scan code set 2 (F0 02) and typematic rate (F3 20), with
+// the relay cut meanwhile, then reports
+//
+//  B bat <stats>      ms from the reset command to AA
+//  B ack <stats>      us from the ack bit of a command to the FA start bit
+//  B clock <stats>    keyboard clock period in CPU cycles (62.5 ns)
+//  B timeouts <n> resends <n> errors <n>
+//
+// with <stats> as in stats.h. The clock is sampled on every bit of every
+// keyboard frame, the min/max spread and the histogram give the jitter.
+// A reply missing after HOSTEMU_TIMEOUT (HOSTEMU_BAT_TIMEOUT for AA)
+// counts as a timeout and the script goes on.
+
+#define HOSTEMU_ROUNDS 16
+#define HOSTEMU_TIMEOUT 25000UL		// us, the spec allows 20 ms
+#define HOSTEMU_BAT_TIMEOUT 2000000UL	// us
+
+struct HostEmu {
+	uint8_t active;
+	uint8_t round;
+	uint8_t step;		// into the command script
+	uint8_t wait;		// reply awaited, 0: the next command is due
+	uint32_t deadline;	// us
+	uint32_t reset_at;	// us, ack bit of FF
+	volatile uint32_t sent_at;	// us, ack bit of the last command
+	volatile uint32_t frame_at;	// us, start bit of the last keyboard frame
+	uint16_t edge_at;	// cycles, previous clock edge
+	uint16_t timeouts;
+	uint16_t resends;
+	uint16_t errors;	// BAT failure or an unexpected reply
+	uint8_t report;		// next report line, 1 based, 0: none
+	Stats bat;
+	Stats ack;
+	Stats clock;
+};
+
+extern HostEmu hostemu;
+
+void hostemu_init(HostEmu *h);
+void hostemu_start(HostEmu *h);
+void hostemu_edge(HostEmu *h, PS2IF *dev);	// from intr(), falling edge
+bool hostemu_device_byte(HostEmu *h, uint8_t c);	// true: consumed
+void hostemu_poll(HostEmu *h);
+
+#endif // HOSTEMU_ENABLED
+
+#endif // HOSTEMU_H
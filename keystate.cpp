@@ -0,0 +1,128 @@
+
+#include "keystate.h"
+
+#ifdef KEYSTATE_ENABLED
+
+#include "ps2.h"
+#include "report.h"
+#include <string.h>
+
+KeyState keystate;
+
+static void clear_keys(KeyState *ks)
+{
+	memset(ks->keys, 0, sizeof(ks->keys));
+	ks->changed = 1;
+}
+
+void keystate_init(KeyState *ks)
+{
+	memset(ks, 0, sizeof(*ks));
+}
+
+void keystate_host_byte(KeyState *ks, uint8_t c)
+{
+	if (ks->host_cmd == 0xed && c < 0x80) {	// set LEDs argument
+		ks->leds = c & 0x07;
+		ks->changed = 1;
+	} else if (c == 0xff) {	// reset
+		ks->leds = 0;
+		clear_keys(ks);
+	}
+	ks->host_cmd = c;
+}
+
+void keystate_device_byte(KeyState *ks, uint8_t c)
+{
+	uint16_t ev = ps2decode(&ks->decoder, c);
+	uint8_t k = ev & 0xff;
+	uint8_t mask = 1 << (k & 7);
+	if (ev & PS2_EVENT_MAKE) {
+		if (!(ks->keys[k >> 3] & mask)) {	// ignore typematic repeats
+			ks->keys[k >> 3] |= mask;
+			ks->changed = 1;
+		}
+	} else if (ev & PS2_EVENT_BREAK) {
+		ks->keys[k >> 3] &= ~mask;
+		ks->changed = 1;
+	} else if (ev == (PS2_EVENT_RAW | 0xaa)) {	// self test passed
+		clear_keys(ks);
+	}
+}
+
+void keystate_set_mode(KeyState *ks, uint8_t mode)
+{
+	ks->mode = mode;
+	ks->elapsed = 0;
+	if (mode != KEYSTATE_SNAPSHOT_OFF) {
+		keystate_snapshot(ks);	// deltas start from a known state
+	}
+}
+
+void keystate_snapshot(KeyState *ks)
+{
+	print("K ");
+	for (uint8_t i = 0; i < sizeof(ks->keys); i++) {
+		print_hex(ks->keys[i]);
+	}
+	print(" ");
+	print_hex(ks->leds);
+	print_crlf();
+	memcpy(ks->prev_keys, ks->keys, sizeof(ks->keys));
+	ks->prev_leds = ks->leds;
+	ks->changed = 0;
+	ks->frames = 0;
+}
+
+// at most 12 keys per line, so a line fits one log record, and no
+// line at all without a change
+static void delta(KeyState *ks)
+{
+	ks->changed = 0;
+	if (ks->leds == ks->prev_leds && !memcmp(ks->keys, ks->prev_keys, sizeof(ks->keys))) return;
+	uint8_t n = 0;
+	print("k");
+	for (uint8_t i = 0; i < sizeof(ks->keys); i++) {
+		if (ks->keys[i] != ks->prev_keys[i]) {
+			if (n++ == 12) {
+				print_crlf();
+				print("k");
+				n = 1;
+			}
+			print(" ");
+			print_hex(i);
+			print(":");
+			print_hex(ks->keys[i]);
+			ks->prev_keys[i] = ks->keys[i];
+		}
+	}
+	if (ks->leds != ks->prev_leds) {
+		print(" L:");
+		print_hex(ks->leds);
+		ks->prev_leds = ks->leds;
+	}
+	print_crlf();
+}
+
+void keystate_poll(KeyState *ks, bool timer_event_flag)
+{
+	switch (ks->mode) {
+	case KEYSTATE_SNAPSHOT_ON_CHANGE:
+		if (ks->changed) {
+			delta(ks);
+		}
+		break;
+	case KEYSTATE_SNAPSHOT_PERIODIC:
+		if (timer_event_flag && ++ks->elapsed >= KEYSTATE_PERIOD) {
+			ks->elapsed = 0;
+			if (++ks->frames >= KEYSTATE_KEYFRAME) {
+				keystate_snapshot(ks);
+			} else {
+				delta(ks);
+			}
+		}
+		break;
+	}
+}
+
+#endif // KEYSTATE_ENABLED
@@ -0,0 +1,59 @@
+#ifndef KEYSTATE_H
+#define KEYSTATE_H
+
+#include <stdint.h>
+
+//#define KEYSTATE_ENABLED
+
+#ifdef KEYSTATE_ENABLED
+
+// pressed-key bitmap and lock LED state, indexed by ps2decode() key index
+
+enum {
+	KEYSTATE_LED_SCROLL = 0x01,
+	KEYSTATE_LED_NUM = 0x02,
+	KEYSTATE_LED_CAPS = 0x04,
+};
+
+// snapshot output over CDC
+//
+//  K <64 hex digits> <leds>    full snapshot (bitmap byte 0 first)
+//  k[ ii:vv]...[ L:vv]          changes since the previous snapshot
+//
+// The 32 bitmap bytes go out as hex: raw bytes could contain CR LF and
+// break the line framing of the log. A delta line is only sent when
+// something changed, periodic mode included.
+enum {
+	KEYSTATE_SNAPSHOT_OFF,
+	KEYSTATE_SNAPSHOT_ON_CHANGE,
+	KEYSTATE_SNAPSHOT_PERIODIC,
+};
+
+#define KEYSTATE_PERIOD 100	// ms
+#define KEYSTATE_KEYFRAME 10	// periodic mode: full snapshot every N periods
+
+struct KeyState {
+	uint8_t keys[32];
+	uint8_t leds;
+	uint8_t decoder;
+	uint8_t host_cmd;	// last byte from the host, to catch LED arguments
+	uint8_t changed;
+	uint8_t mode;
+	uint8_t elapsed;	// ms into the current period
+	uint8_t frames;		// periods since the last full snapshot
+	uint8_t prev_keys[32];
+	uint8_t prev_leds;
+};
+
+extern KeyState keystate;
+
+void keystate_init(KeyState *ks);
+void keystate_host_byte(KeyState *ks, uint8_t c);
+void keystate_device_byte(KeyState *ks, uint8_t c);
+void keystate_set_mode(KeyState *ks, uint8_t mode);
+void keystate_snapshot(KeyState *ks);
+void keystate_poll(KeyState *ks, bool timer_event_flag);
+
+#endif // KEYSTATE_ENABLED
+
+#endif // KEYSTATE_H
@@ -10,8 +10,8 @@
 #define LCD_BACKLIGHT 0x08
 #define ENABLE 0x04
 
-avr::GPIO<avr::B, 4> i2c_clk;
-avr::GPIO<avr::B, 5> i2c_dat;
+typedef avr::OpenDrain<avr::B, 4, true> i2c_clk;
+typedef avr::OpenDrain<avr::B, 5, true> i2c_dat;
 
 // software I2C
 class I2C {
@@ -24,33 +24,33 @@ private:
 	// 初期化
 	void init_i2c()
 	{
-		i2c_clk.setpullup(true);
-		i2c_dat.setpullup(true);
+		i2c_clk::release();
+		i2c_dat::release();
 	}
 
 	void i2c_cl_0()
 	{
-		i2c_clk.write(false);
+		i2c_clk::low();
 	}
 
 	void i2c_cl_1()
 	{
-		i2c_clk.write(true);
+		i2c_clk::release();
 	}
 
 	void i2c_da_0()
 	{
-		i2c_dat.write(false);
+		i2c_dat::low();
 	}
 
 	void i2c_da_1()
 	{
-		i2c_dat.write(true);
+		i2c_dat::release();
 	}
 
 	uint8_t i2c_get_da()
 	{
-		return i2c_dat.read();
+		return i2c_dat::read();
 	}
 
 	// スタートコンディション
@@ -26,21 +26,26 @@
 
 #include "lcd.h"
 #include "usb.h"
-#include <avr/interrupt.h>
+#include "hal.h"
+#include "avrgpio.h"
 #include <string.h>
 #include "waitloop.h"
+#include "cdc.h"
+#include "report.h"
+#include "sched.h"
 
 #define CLOCK 16000000UL
 #define SCALE 125
 static unsigned short _scale = 0;
-//static unsigned long _system_tick_count;
+static volatile uint32_t _system_tick_count; // 128us per tick
 //static unsigned long _tick_count;
 //static unsigned long _time_s;
 //static unsigned short _time_ms = 0;
 uint8_t interval_1ms_flag = 0;
 ISR(TIMER0_OVF_vect, ISR_NOBLOCK)
 {
-//	_system_tick_count++;
+	PROFILE_ISR_ENTER();
+	_system_tick_count++;
 	_scale += 16;
 	if (_scale >= SCALE) {
 		_scale -= SCALE;
@@ -51,123 +56,35 @@ ISR(TIMER0_OVF_vect, ISR_NOBLOCK)
 //			_time_s++;
 //		}
 		interval_1ms_flag = 1;
+		sched_post(SCHED_RELAY);
+		sched_post(SCHED_REPORT);
 	}
+	PROFILE_ISR_EXIT(PROFILE_TIMER0);
 }
 
-extern "C" void led(uint8_t f)
-{
-	if (f) {
-		PORTB |= 0x01;
-	} else {
-		PORTB &= ~0x01;
-	}
-}
-
-
-
-
-
-
-extern "C" uint8_t usb_read_available_();
-extern "C" uint8_t usb_read_byte_();
-
-uint8_t data_tx_buffer[64];
-uint8_t data_tx_buffer_i;
-uint8_t data_tx_buffer_n;
-
-uint8_t data_rx_buffer[256];
-int data_rx_buffer_i;
-int data_rx_buffer_n;
-
-extern "C" void clear_buffers()
-{
-	data_tx_buffer_i = 0;
-	data_tx_buffer_n = 0;
-	data_rx_buffer_i = 0;
-	data_rx_buffer_n = 0;
-}
-
-void usb_poll_tx()
+// microseconds since boot (wraps after 71 minutes)
+uint32_t micros()
 {
-	uint8_t tmp[TX_EP_SIZE];
-	while (1) {
-		uint8_t n = data_tx_buffer_n;
-		n = n < sizeof(tmp) ? n : sizeof(tmp);
-		if (n == 0) break;
-		for (uint8_t i = 0; i < data_tx_buffer_n; i++) {
-			tmp[i] = data_tx_buffer[data_tx_buffer_i];
-			data_tx_buffer_i = (data_tx_buffer_i + 1) % sizeof(data_tx_buffer);
-		}
-		usb_data_tx(tmp, n);
-		data_tx_buffer_n -= n;
+	uint8_t sreg = hal_irq_save();
+	uint32_t n = _system_tick_count;
+	uint8_t t = TCNT0;
+	if ((TIFR0 & (1 << TOV0)) && t < 0xff) {
+		n++;	// overflow not serviced yet
 	}
+	hal_irq_restore(sreg);
+	return (n << 7) | (t >> 1);
 }
 
+typedef avr::GPIO<avr::B, 0> led_pin;
 
-static inline void usb_poll_rx()
-{
-	int space = sizeof(data_rx_buffer) - 1 - data_rx_buffer_n;
-	while (space > 0) {
-		uint8_t tmp[16];
-		int n = sizeof(tmp);
-		n = usb_data_rx(tmp, n < space ? n : space);
-		if (n == 0) break;
-		for (uint8_t i = 0; i < n; i++) {
-			int j = (data_rx_buffer_i + data_rx_buffer_n) % sizeof(data_rx_buffer);
-			data_rx_buffer[j] = tmp[i];
-			data_rx_buffer_n++;
-		}
-		space -= n;
-	}
-}
-
-void usb_poll()
-{
-	usb_poll_tx();
-	usb_poll_rx();
-}
-
-static inline int usb_read_available()
-{
-	return data_rx_buffer_n + usb_read_available_();
-}
-
-static inline uint8_t usb_read_byte()
-{
-	for (int i = 0; i < 2; i++) {
-		if (data_rx_buffer_n > 0) {
-			uint8_t c = data_rx_buffer[data_rx_buffer_i];
-			data_rx_buffer_i = (data_rx_buffer_i + 1) % sizeof(data_rx_buffer);
-			data_rx_buffer_n--;
-			return c;
-		}
-		usb_poll_rx();
-	}
-	return 0;
-}
-
-void usb_write_byte(char c)
+extern "C" void led(uint8_t f)
 {
-	while (1) {
-		if (data_tx_buffer_n < sizeof(data_tx_buffer)) {
-			int8_t i = (data_tx_buffer_i + data_tx_buffer_n) % sizeof(data_tx_buffer);
-			data_tx_buffer[i] = c;
-			data_tx_buffer_n++;
-			if (data_tx_buffer_n >= TX_EP_SIZE - 1) {
-				usb_poll_tx();
-			}
-			return;
-		}
-		usb_poll();
-	}
+	led_pin::write(f);
 }
 
-
-
-
-
 void keyboard_setup();
 void ps2_loop();
+bool ps2_idle();
 
 #ifdef LCD_ENABLED
 
@@ -182,12 +99,13 @@ uint8_t lcd_size = 0;
 
 extern "C" void lcd_putchar(uint8_t c)
 {
-	cli();
+	hal_irq_disable();
 	if (lcd_size < 128 && c != 0) {
 		lcd_queue[(lcd_head + lcd_size) & 0x7f] = c;
 		lcd_size++;
 	}
-	sei();
+	hal_irq_enable();
+	sched_post(SCHED_LCD);
 }
 
 extern "C" void lcd_print(char const *p)
@@ -212,61 +130,39 @@ extern "C" void lcd_home()
 static uint8_t lcd_popfront()
 {
 	uint8_t c = 0;
-	cli();
+	hal_irq_disable();
 	if (lcd_size > 0) {
 		c = lcd_queue[lcd_head];
 		lcd_head = (lcd_head + 1) & 0x7f;
 		lcd_size--;
 	}
-	sei();
+	hal_irq_enable();
 	return c;
 }
 
-#endif //  LCD_ENABLED
-
-
-void putchar(uint8_t c)
+static void lcd_task()
 {
-	usb_write_byte(c);
-}
-
-void print(char const *p)
-{
-	while (*p) {
-		putchar(*p);
-		p++;
+	uint8_t c = lcd_popfront();
+	if (c == LCD_NONE) return;
+	if (c < ' ') {
+		if (c == LCD_HOME) {
+			lcd::home();
+		}
+	} else {
+		lcd::putchar(c);
 	}
+	if (lcd_size > 0) sched_post(SCHED_LCD);
 }
 
-void print_hex(uint8_t c)
-{
-	static char hex[] = "0123456789ABCDEF";
-	putchar(hex[(c >> 4) & 0x0f]);
-	putchar(hex[c & 0x0f]);
-}
-
-void print_crlf()
-{
-	putchar('\r');
-	putchar('\n');
-}
+#endif //  LCD_ENABLED
 
-void report_host_to_device(uint8_t c)
-{
-	print("H ");
-	print_hex(c);
-	print(" ->    D");
-	print_crlf();
+// main loop tasks by priority, see sched.h
+#ifdef LCD_ENABLED
+static SchedTask const tasks[SCHED_TASKS] = SCHED_MAIN_TASKS(lcd_task);
+#else
+static SchedTask const tasks[SCHED_TASKS] = SCHED_MAIN_TASKS(nullptr);
+#endif
 
-}
-
-void report_device_to_host(uint8_t c)
-{
-	print("H    <- ");
-	print_hex(c);
-	print(" D");
-	print_crlf();
-}
 
 void setup()
 {
@@ -283,12 +179,18 @@ void setup()
 	TCCR0B = 0x02; // 1/8 prescaling
 	TIMSK0 |= 1 << TOIE0;
 
+#ifdef PROFILE_ENABLED
+	profile_init();
+#endif
+
 	usb_init();
 	while (!is_usb_configured()) {
 		msleep(10);
 	}
 
 	keyboard_setup();
+	report_init();
+	sched_init(tasks);
 
 #ifdef LCD_ENABLED
 	lcd::init();
@@ -298,31 +200,14 @@ void setup()
 #endif
 }
 
-void loop()
-{
-	ps2_loop();
-}
-
 int main()
 {
 	setup();
 	sei();
 	while (1) {
-		usb_poll();
-#ifdef LCD_ENABLED
-		uint8_t c = lcd_popfront();
-		if (c == LCD_NONE) {
-			loop();
-		} else if (c < ' ') {
-			if (c == LCD_HOME) {
-				lcd::home();
-			}
-		} else {
-			lcd::putchar(c);
+		if (!sched_poll() && ps2_idle() && usb_tx_idle()) {
+			sched_sleep();
 		}
-#else
-		loop();
-#endif
 	}
 }
 
@@ -0,0 +1,160 @@
+
+#include "mouse.h"
+
+#ifdef MOUSE_ENABLED
+
+#include "report.h"
+#include "usb.h"
+
+Mouse mouse;
+
+void mouse_init(Mouse *m)
+{
+	m->id = MOUSE_ID_NONE;
+	m->host_cmd = 0;
+	m->resp = 0;
+	m->last = 0;
+	m->n = 0;
+	m->sync_errors = 0;
+	m->coalesce = false;
+	m->merged = 0;
+}
+
+static uint8_t packet_size(Mouse *m)
+{
+	return m->id == MOUSE_ID_STANDARD ? 3 : 4;
+}
+
+void mouse_host_byte(Mouse *m, uint8_t c)
+{
+	m->n = 0;	// the mouse discards a partial packet on any command
+	m->host_cmd = c;
+	switch (c) {
+	case 0xf2: m->resp = 2; break;	// ACK, ID
+	case 0xe9: m->resp = 4; break;	// ACK, 3 status bytes
+	case 0xff: m->resp = 2; break;	// ACK, AA (a mouse adds ID 00)
+	default: m->resp = 1; break;	// ACK
+	}
+}
+
+static void print_signed(int16_t v)
+{
+	if (v < 0) {
+		print("-");
+		v = -v;
+	} else {
+		print("+");
+	}
+	print_dec(v);
+}
+
+void mouse_flush(Mouse *m)
+{
+	if (m->merged == 0) return;
+	print("M ");
+	print_hex(m->buttons);
+	print(" ");
+	print_signed(m->dx);
+	print(" ");
+	print_signed(m->dy);
+	if (m->id != MOUSE_ID_STANDARD) {
+		print(" ");
+		print_signed(m->dz);
+	}
+	if (m->merged > 1) {
+		print(" *");
+		print_dec(m->merged);
+	}
+	print_crlf();
+	m->merged = 0;
+}
+
+// the sums must stay in range of their fields, or the merged line would
+// show the wrong magnitude and sign
+static bool fits(Mouse *m, int16_t dx, int16_t dy, int8_t dz)
+{
+	int32_t x = (int32_t)m->dx + dx;
+	int32_t y = (int32_t)m->dy + dy;
+	int16_t z = m->dz + dz;
+	return x >= -32768 && x <= 32767 && y >= -32768 && y <= 32767 && z >= -128 && z <= 127;
+}
+
+static void packet(Mouse *m)
+{
+	uint8_t const *p = m->packet;
+	uint8_t buttons = p[0] & 0x07;
+	int16_t dx = (p[0] & 0x10) ? (int16_t)p[1] - 256 : p[1];
+	int16_t dy = (p[0] & 0x20) ? (int16_t)p[2] - 256 : p[2];
+	int8_t dz = 0;
+	if (m->id == MOUSE_ID_INTELLIMOUSE) {
+		dz = (int8_t)p[3];
+	} else if (m->id == MOUSE_ID_EXPLORER) {
+		dz = (int8_t)(p[3] << 4) >> 4;
+		buttons |= (p[3] >> 1) & 0x18;	// buttons 4 and 5
+	}
+
+	if (m->merged > 0) {
+		if (m->buttons == buttons && m->merged < 0xffff && fits(m, dx, dy, dz)) {
+			m->dx += dx;
+			m->dy += dy;
+			m->dz += dz;
+			m->merged++;
+			return;
+		}
+		mouse_flush(m);	// nor button transitions
+	}
+	m->buttons = buttons;
+	m->dx = dx;
+	m->dy = dy;
+	m->dz = dz;
+	m->merged = 1;
+	if (!m->coalesce || usb_data_tx_ready()) {
+		mouse_flush(m);
+	}
+}
+
+// returns true if the byte was taken into a packet and must not be logged
+bool mouse_device_byte(Mouse *m, uint8_t c)
+{
+	uint8_t last = m->last;
+	m->last = c;
+
+	if (m->resp > 0) {
+		if (c == 0xfe || c == 0xfc) {	// resend, error
+			m->resp = 0;
+		} else {
+			m->resp--;
+			if (m->resp == 0 && m->host_cmd == 0xf2) {
+				bool known = c == MOUSE_ID_STANDARD || c == MOUSE_ID_INTELLIMOUSE || c == MOUSE_ID_EXPLORER;
+				m->id = known ? c : (uint8_t)MOUSE_ID_NONE;
+			}
+		}
+		return false;
+	}
+	if (last == 0xaa && c == 0x00) {	// power-on BAT of a mouse
+		m->id = MOUSE_ID_STANDARD;
+		m->n = 0;
+		return false;
+	}
+	if (m->id == MOUSE_ID_NONE) return false;
+
+	if (m->n == 0 && !(c & 0x08)) {	// bit 3 is always set in the first byte
+		m->sync_errors++;
+		return false;
+	}
+	m->packet[m->n++] = c;
+	if (m->n == packet_size(m)) {
+		m->n = 0;
+		packet(m);
+	}
+	return true;
+}
+
+void mouse_poll(Mouse *m)
+{
+	if (m->merged > 0 && usb_data_tx_ready()) {
+		mouse_flush(m);
+	}
+}
+
+#endif // MOUSE_ENABLED
@@ -0,0 +1,52 @@
+#ifndef MOUSE_H
+#define MOUSE_H
+
+#include <stdint.h>
+
+//#define MOUSE_ENABLED
+
+#ifdef MOUSE_ENABLED
+
+// PS/2 mouse packet assembly for the capture log
+//
+// The device type is learned from the BAT sequence (AA 00) and from the
+// reply to a get device ID (F2) command. Movement packets are reported as
+//  M <buttons> <dx> <dy> [<dz>] [*<packets>]
+// one line per packet. With coalescing enabled, packets that arrive while
+// the USB IN endpoint is busy are summed into a single line as long as
+// the button state does not change and the sums fit their fields.
+
+enum {
+	MOUSE_ID_NONE = 0xff,
+	MOUSE_ID_STANDARD = 0x00,
+	MOUSE_ID_INTELLIMOUSE = 0x03,
+	MOUSE_ID_EXPLORER = 0x04,
+};
+
+struct Mouse {
+	uint8_t id;
+	uint8_t host_cmd;
+	uint8_t resp;			// response bytes still expected for host_cmd
+	uint8_t last;			// previous device byte
+	uint8_t packet[4];
+	uint8_t n;
+	uint8_t sync_errors;
+	bool coalesce;
+	uint8_t buttons;		// pending coalesced event
+	int16_t dx;
+	int16_t dy;
+	int8_t dz;
+	uint16_t merged;
+};
+
+extern Mouse mouse;
+
+void mouse_init(Mouse *m);
+void mouse_host_byte(Mouse *m, uint8_t c);
+bool mouse_device_byte(Mouse *m, uint8_t c);
+void mouse_flush(Mouse *m);
+void mouse_poll(Mouse *m);
+
+#endif // MOUSE_ENABLED
+
+#endif // MOUSE_H
@@ -0,0 +1,124 @@
+
+#include "profile.h"
+
+#ifdef PROFILE_ENABLED
+
+#include "report.h"
+#include <avr/interrupt.h>
+#include <avr/io.h>
+
+struct Profile {
+	uint8_t off;	// interrupts-off window open
+	uint16_t off_start;
+	uint16_t off_max;
+	uint16_t off_site;	// word address where the longest window ended
+	uint16_t off_late;	// windows longer than PROFILE_DEADLINE
+	uint16_t isr_max[PROFILE_VECTORS];
+	uint8_t depth;
+	uint8_t depth_max;
+};
+
+static Profile profile;
+
+static void close_window(uint16_t now, uint16_t site)
+{
+	if (!profile.off) return;
+	profile.off = 0;
+	uint16_t d = now - profile.off_start;
+	if (d > profile.off_max) {
+		profile.off_max = d;
+		profile.off_site = site;
+	}
+	if (d > PROFILE_DEADLINE) {
+		profile.off_late++;
+	}
+}
+
+extern "C" void profile_init()
+{
+	TCCR1A = 0;
+	TCCR1B = 1 << CS10;	// clk/1
+}
+
+// called right after cli()
+extern "C" void profile_irq_off()
+{
+	if (!profile.off) {
+		profile.off = 1;
+		profile.off_start = TCNT1;
+	}
+}
+
+// called right before sei()
+extern "C" void profile_irq_on()
+{
+	close_window(TCNT1, (uint16_t)(uintptr_t)__builtin_return_address(0));
+}
+
+extern "C" uint16_t profile_isr_enter()
+{
+	uint8_t sreg = SREG;
+	cli();
+	uint16_t t = TCNT1;
+	if (!(sreg & 0x80) && !profile.off) {	// entered with I cleared by hardware
+		profile.off = 1;
+		profile.off_start = t;
+	}
+	profile.depth++;
+	if (profile.depth > profile.depth_max) {
+		profile.depth_max = profile.depth;
+	}
+	SREG = sreg;
+	return t;
+}
+
+extern "C" void profile_isr_exit(uint8_t vector, uint16_t t)
+{
+	uint8_t sreg = SREG;
+	cli();
+	uint16_t now = TCNT1;
+	uint16_t d = now - t;
+	if (d > profile.isr_max[vector]) {
+		profile.isr_max[vector] = d;
+	}
+	profile.depth--;
+	if (!(sreg & 0x80)) {	// reti sets I again
+		close_window(now, (uint16_t)(uintptr_t)__builtin_return_address(0));
+	}
+	SREG = sreg;
+}
+
+// P off <max> @<site> late <n> isr <int0> <int5> <t0> <t1> <usbgen> <usbcom> depth <n>
+//
+// Cycles since the previous report, which starts a new measurement.
+extern "C" void profile_report()
+{
+	Profile p;
+	uint8_t sreg = SREG;
+	cli();
+	p = profile;
+	uint8_t off = profile.off;
+	uint16_t start = profile.off_start;
+	profile = Profile();
+	profile.off = off;
+	profile.off_start = start;
+	SREG = sreg;
+
+	print("P off ");
+	print_dec(p.off_max);
+	print(" @");
+	print_hex(p.off_site >> 8);
+	print_hex(p.off_site);
+	print(" late ");
+	print_dec(p.off_late);
+	print(" isr");
+	for (uint8_t i = 0; i < PROFILE_VECTORS; i++) {
+		print(" ");
+		print_dec(p.isr_max[i]);
+	}
+	print(" depth ");
+	print_dec(p.depth_max);
+	print_crlf();
+}
+
+#endif // PROFILE_ENABLED
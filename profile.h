@@ -0,0 +1,56 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+
+//#define PROFILE_ENABLED
+
+#ifdef PROFILE_ENABLED
+
+// worst-case interrupt latency profiler
+//
+// Timer1 runs free at the CPU clock, so every timestamp is in cycles
+// (wraps after 4.096 ms). The hal_irq_*() critical sections and the ISR
+// entry/exit hooks below track the longest window with interrupts off,
+// the longest run of each vector and the ISR nesting depth. A PS/2 clock
+// phase is at least 30 us, windows longer than that are counted as
+// deadline misses.
+
+#define PROFILE_DEADLINE 480	// cycles, 30 us at 16 MHz
+
+enum {
+	PROFILE_INT0,	// keyboard clock
+	PROFILE_INT5,	// PC clock
+	PROFILE_TIMER0,
+	PROFILE_TIMER1,	// PS/2 frame watchdog
+	PROFILE_USB_GEN,
+	PROFILE_USB_COM,
+	PROFILE_VECTORS,
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void profile_init(void);
+void profile_irq_off(void);
+void profile_irq_on(void);
+uint16_t profile_isr_enter(void);
+void profile_isr_exit(uint8_t vector, uint16_t t);
+void profile_report(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define PROFILE_ISR_ENTER() uint16_t profile_t = profile_isr_enter()
+#define PROFILE_ISR_EXIT(vector) profile_isr_exit(vector, profile_t)
+
+#else
+
+#define PROFILE_ISR_ENTER()
+#define PROFILE_ISR_EXIT(vector)
+
+#endif // PROFILE_ENABLED
+
+#endif // PROFILE_H
@@ -0,0 +1,36 @@
+
+#include "ps2.h"
+
+enum {
+	STATE_E0 = 0x01,
+	STATE_F0 = 0x02,
+	STATE_E1 = 0x70,	// E1 sequence: 7 bytes follow the first E1
+};
+
+// scan code set 2 decoder
+
+uint16_t ps2decode(uint8_t *state, uint8_t c)
+{
+	uint8_t s = *state;
+	if (s & 0xf0) {	// inside the pause key sequence
+		*state = s - 0x10;
+		return PS2_EVENT_RAW | c;
+	}
+	switch (c) {
+	case 0xe0:
+		*state = s | STATE_E0;
+		return PS2_EVENT_NONE;
+	case 0xf0:
+		*state = s | STATE_F0;
+		return PS2_EVENT_NONE;
+	case 0xe1:
+		*state = STATE_E1;
+		return PS2_EVENT_RAW | c;
+	}
+	*state = 0;
+	if (c == 0 || c > 0x84) {
+		return PS2_EVENT_RAW | c;
+	}
+	uint16_t ev = (s & STATE_E0) ? (0x80 | c) : c;
+	return ev | ((s & STATE_F0) ? PS2_EVENT_BREAK : PS2_EVENT_MAKE);
+}
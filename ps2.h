@@ -4,6 +4,15 @@
 
 #include <stdint.h>
 
+// ps2decode() result: key index in the low byte, plus one of these flags.
+// Extended (E0) keys are reported as 0x80 | code. Zero means a prefix
+// byte was consumed. Bytes that are not key codes (responses, the pause
+// key sequence) are returned unchanged with PS2_EVENT_RAW.
+#define PS2_EVENT_NONE 0x000
+#define PS2_EVENT_MAKE 0x100
+#define PS2_EVENT_BREAK 0x200
+#define PS2_EVENT_RAW 0x400
+
 uint8_t convert_scan_code_ibm_to_hid(uint8_t c);
 
 uint16_t ps2decode(uint8_t *state, uint8_t c);
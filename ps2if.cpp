@@ -1,65 +1,101 @@
-
-#include <avr/io.h>
+#include "avrgpio.h"
+#include "ps2if.h"
+
+// PORTD: 0 kb clock in (INT0), 1 kb clock out, 2 kb data in, 3 kb data out,
+//        4 pc clock in (INT5), 5 pc clock out, 6 pc data in, 7 pc data out
+// An output high pulls its line low through the transistor.
+typedef avr::GPIO<avr::D, 0> kb_clock_in;
+typedef avr::GPIO<avr::D, 1> kb_clock_out;
+typedef avr::GPIO<avr::D, 2> kb_data_in;
+typedef avr::GPIO<avr::D, 3> kb_data_out;
+typedef avr::GPIO<avr::D, 4> pc_clock_in;
+typedef avr::GPIO<avr::D, 5> pc_clock_out;
+typedef avr::GPIO<avr::D, 6> pc_data_in;
+typedef avr::GPIO<avr::D, 7> pc_data_out;
+typedef avr::PortBits<avr::D, kb_clock_out::bit | kb_data_out::bit | pc_clock_out::bit | pc_data_out::bit> drivers;
+typedef avr::PortBits<avr::D, kb_clock_in::bit | kb_data_in::bit | pc_clock_in::bit | pc_data_in::bit> sensors;
+
+void ps2if_init()
+{
+	drivers::write(0);	// all lines released
+	drivers::output();
+	sensors::write(0);	// no pull-ups, the bus has its own
+	sensors::input();
+
+	EIMSK |= 0x21;
+	EICRA = 0x01;
+	EICRB = 0x04;
+}
 
 void pc_set_clock_0()
 {
-	PORTD |= 0x20;
+	pc_clock_out::set();
 }
 
 void pc_set_clock_1()
 {
-	PORTD &= ~0x20;
+	pc_clock_out::clear();
 }
 
 void pc_set_data_0()
 {
-	PORTD |= 0x80;
+	pc_data_out::set();
 }
 
 void pc_set_data_1()
 {
-	PORTD &= ~0x80;
+	pc_data_out::clear();
 }
 
 bool pc_get_clock()
 {
-	return (PIND >> 4) & 1;
+	return pc_clock_in::read();
 }
 
 bool pc_get_data()
 {
-	return (PIND >> 6) & 1;
+	return pc_data_in::read();
+}
+
+bool pc_clock_driven()
+{
+	return pc_clock_out::driven();
 }
 
 
 void kb0_set_clock_0()
 {
-	PORTD |= 0x02;
+	kb_clock_out::set();
 }
 
 void kb0_set_clock_1()
 {
-	PORTD &= ~0x02;
+	kb_clock_out::clear();
 }
 
 void kb0_set_data_0()
 {
-	PORTD |= 0x08;
+	kb_data_out::set();
 }
 
 void kb0_set_data_1()
 {
-	PORTD &= ~0x08;
+	kb_data_out::clear();
 }
 
 bool kb0_get_clock()
 {
-	return (PIND >> 0) & 1;
+	return kb_clock_in::read();
 }
 
 bool kb0_get_data()
 {
-	return (PIND >> 2) & 1;
+	return kb_data_in::read();
+}
+
+bool kb0_clock_driven()
+{
+	return kb_clock_out::driven();
 }
 
 #if 0
@@ -2,18 +2,44 @@
 #ifndef PS2IF_H
 #define PS2IF_H
 
+#include <stdint.h>
+#include "queue.h"
+
+//#define DEGLITCH_ENABLED
+
+// deglitch stage of the keyboard clock interrupt, see intr()
+//
+// An edge closer than PS2_MIN_EDGE to the previous accepted one is
+// ringing and ignored. Otherwise clock and data are read three times
+// PS2_SAMPLE_SPACING apart and the majority counts; an edge that leaves
+// the clock where it was is a glitch. Both kinds go to PS2IF::glitches.
+// A receive that sees the clock high longer than PS2_MAX_PHASE lost an
+// edge to the noise, the falling edge after it starts the next frame.
+// The cycle count wraps every 4.096 ms, so the edge is also stamped with
+// micros(): one older than PS2_EDGE_AGE is neither near nor in a phase,
+// whatever its cycles say. Costs 2 us per edge in the interrupt handler.
+
+#define PS2_MIN_EDGE (10 * 16)	// cycles, a clock phase is at least 30 us
+#define PS2_MAX_PHASE (60 * 16)	// cycles, and at most 50 us
+#define PS2_SAMPLE_SPACING 1	// us
+#define PS2_EDGE_AGE 1000	// us, well below the wrap of hal_cycles()
+
+void ps2if_init();
+
 void pc_set_clock_0();
 void pc_set_clock_1();
 void pc_set_data_0();
 void pc_set_data_1();
 bool pc_get_clock();
 bool pc_get_data();
+bool pc_clock_driven();	// our clock output is pulling the line low
 void kb0_set_clock_0();
 void kb0_set_clock_1();
 void kb0_set_data_0();
 void kb0_set_data_1();
 bool kb0_get_clock();
 bool kb0_get_data();
+bool kb0_clock_driven();
 void kb1_set_clock_0();
 void kb1_set_clock_1();
 void kb1_set_data_0();
@@ -87,4 +113,56 @@ public:
 	}
 };
 
+struct PS2IF {
+	AbstractPS2IO *io;
+	uint16_t input_bits;
+	uint16_t output_bits;
+	uint8_t watchdog_laps;	// PS2_LAP periods left before the watchdog fires
+	uint16_t errors;	// bad parity, missing stop bit or watchdog aborts
+	uint8_t edges;		// falling clock edges seen by intr()
+#ifdef DEGLITCH_ENABLED
+	uint16_t edge_at;	// cycles, last accepted edge
+	uint32_t edge_us;	// the same edge in us
+	bool clock_level;	// after that edge, true: high
+	uint16_t glitches;
+#endif
+	// transmit scheduler state, see ps2d_poll_output()
+	uint8_t tx_state;
+	uint8_t tx_byte;
+	uint8_t tx_retries;
+	bool tx_acked;		// the keyboard pulled the ack bit low
+	uint8_t tx_edges;	// edges at the previous pass
+	uint32_t idle_since;	// us, last clock edge
+	uint32_t tx_at;		// us, start of the wait, the inhibit or end of the backoff
+	// flow control, see ps2d_flow()
+	bool flow_held;		// we hold the clock while the queues drain
+	bool flow_wanted;	// hold after the stop bit of the current frame
+	uint16_t flow_holds;
+	// PC side transmitter, see pc_send()
+	uint8_t clock_low;	// us per bit with the clock held low
+	uint8_t clock_high;	// us per bit with the clock released, at least 15
+	uint8_t last_sent;
+	bool inhibited;		// the previous pc_send() was cut short
+	uint16_t sent;		// bytes clocked out completely
+	uint16_t inhibits;	// transmissions held off or aborted by the PC
+	struct Queue input_queue;
+	struct Queue output_queue;
+	struct Queue inject_queue;	// sent when output_queue is empty
+};
+
+// pc_send() clock timing; the data line changes 15 us before the
+// falling edge, at the end of the high phase
+#define PS2_CLOCK_LOW		40	// us, 14.3 kHz with PS2_CLOCK_HIGH
+#define PS2_CLOCK_LOW_MIN	30	// us, 16.7 kHz, the fastest legal clock
+#define PS2_CLOCK_HIGH		30	// us
+#define PS2_CLOCK_MAX		50	// us, the longest legal low or high phase
+
+extern PS2IF ps2h;
+extern PS2IF ps2d;
+
+void pc_put(PS2IF *host, uint8_t c);
+void pc_resend(PS2IF *host);
+void kb_put(PS2IF *dev, uint8_t c);
+void kb_inject(PS2IF *dev, uint8_t c);
+
 #endif
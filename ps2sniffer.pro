@@ -8,15 +8,45 @@ HEADERS += \
     usb.h \
     ps2.h \
     ps2if.h \
-    queue16.h \
+    shadow.h \
+    queue.h \
     waitloop.h \
     avrgpio.h \
-    lcd.h
+    lcd.h \
+    keystate.h \
+    mouse.h \
+    hal.h \
+    cdc.h \
+    report.h \
+    profile.h \
+    translate.h \
+    remap.h \
+    replay.h \
+    generator.h \
+    hostemu.h \
+    sched.h \
+    stats.h \
+    timing.h
 SOURCES += \
     main.cpp \
+    ps2.cpp \
     ps2if.cpp \
     quckey.cpp \
-    queue16.cpp \
+    shadow.cpp \
+    queue.cpp \
     waitloop.cpp \
     lcd.cpp \
-    usb.c
+    usb.c \
+    keystate.cpp \
+    mouse.cpp \
+    cdc.cpp \
+    report.cpp \
+    profile.cpp \
+    translate.cpp \
+    remap.cpp \
+    replay.cpp \
+    generator.cpp \
+    hostemu.cpp \
+    sched.cpp \
+    stats.cpp \
+    timing.cpp
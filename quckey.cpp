@@ -1,43 +1,49 @@
 
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <avr/pgmspace.h>
+#include "hal.h"
 
-#include "queue16.h"
+#include "queue.h"
 #include "ps2.h"
 #include "ps2if.h"
 #include "waitloop.h"
 #include <stdlib.h>
 #include "lcd.h"
-
-typedef struct Queue16 Queue;
-#define qinit(Q) q16init(Q)
-#define qpeek(Q) q16peek(Q)
-#define qget(Q) q16get(Q)
-#define qput(Q,C) q16put(Q,C)
-#define qunget(Q,C) q16unget(Q,C)
+#include "report.h"
+#include "shadow.h"
+#include "keystate.h"
+#include "translate.h"
+#include "remap.h"
+#include "generator.h"
+#include "hostemu.h"
+#include "timing.h"
+#include "sched.h"
+
+#define qpeek(Q) queue_peek(Q)
+#define qget(Q) queue_get(Q)
+#define qput(Q,C) queue_put(Q,C)
+#define qunget(Q,C) queue_unget(Q,C)
 
 extern "C" void led(uint8_t f);
 
 extern uint8_t interval_1ms_flag; // 1ms interval event
 
-struct PS2IF {
-	AbstractPS2IO *io;
-	uint16_t input_bits;
-	uint16_t output_bits;
-	uint8_t timeout;
-	Queue input_queue;
-	Queue output_queue;
-	Queue event_queue_l;
-	Queue event_queue_h;
-};
-
 PS2DeviceIO ps2d_io;
 PS2HostIO ps2h_io;
 
 PS2IF ps2h;
 PS2IF ps2d;
 
+// frame watchdog
+//
+// Every falling clock edge inside a frame arms the Timer1 compare. If the
+// next edge is overdue, the frame is abandoned and counted in dev->errors,
+// so a glitch or a cut-off frame costs one bit period, not the keystrokes
+// that follow. After a request to send the keyboard gets PS2_RTS_LAPS
+// times PS2_LAP to start clocking (the spec allows 15 ms).
+
+#define PS2_BIT_TIMEOUT 150	// us after an edge, a clock period is 60..100 us
+#define PS2_LAP 4000		// us, the longest single Timer1 timeout
+#define PS2_RTS_LAPS 4
+
 uint8_t countbits(uint16_t c)
 {
 	uint8_t i;
@@ -47,7 +53,74 @@ uint8_t countbits(uint16_t c)
 	return i;
 }
 
-bool ps2d_next_output(PS2IF *dev, uint8_t c)
+// transmit scheduler toward the keyboard
+//
+// ps2d_poll_output() is called every loop pass and never waits. A byte
+// goes out only after the bus has been idle for PS2_IDLE_TIME: no clock
+// edge seen, clock high, no frame in progress. A keyboard streaming
+// back to back frames never leaves that much room, so after
+// PS2_TX_PATIENCE the byte takes the bus like a PC would: the frame in
+// progress is dropped and the keyboard sends it again after our byte.
+// Host commands go before injected bytes. The inhibit before the
+// request to send is timed against micros(), not busy-waited. A byte
+// the keyboard does not acknowledge is retried after an exponential
+// backoff, at most PS2_TX_RETRIES times.
+
+#define PS2_IDLE_TIME 100	// us since the last clock edge
+#define PS2_INHIBIT_TIME 100	// us clock low before the request to send
+#define PS2_TX_PATIENCE 2000	// us waiting for an idle bus
+#define PS2_TX_RETRIES 3
+#define PS2_BACKOFF 500		// us, doubled on every retry
+
+enum {
+	TX_IDLE,
+	TX_WAIT,	// byte taken, waiting for an idle bus
+	TX_INHIBIT,	// clock held low
+	TX_SENDING,	// clock released, the keyboard clocks the frame in
+	TX_BACKOFF,
+};
+
+// flow control toward the keyboard
+//
+// The keyboard buffers its keystrokes while the host holds the clock
+// low. When the keyboard bytes waiting in dev->input_queue or the PC
+// bytes waiting in host->output_queue reach PS2_FLOW_HIGH, the clock is
+// held: by ps2d_flow() between frames, else by intr() right after the
+// next stop bit. ps2d_flow() lets go once both are down to PS2_FLOW_LOW.
+// A byte for the keyboard takes over the hold, its request to send
+// starts with the clock low anyway.
+
+#define PS2_FLOW_HIGH 8		// bytes
+#define PS2_FLOW_LOW 4
+
+static void flow_hold(PS2IF *dev)
+{
+	dev->io->set_clock_0();
+	dev->flow_held = true;
+	dev->flow_wanted = false;
+	dev->flow_holds++;
+}
+
+void ps2d_flow(PS2IF *host, PS2IF *dev)
+{
+	uint8_t in = dev->input_queue.len;
+	uint8_t out = host->output_queue.len;
+	hal_irq_disable();
+	if (dev->flow_held) {
+		if (in <= PS2_FLOW_LOW && out <= PS2_FLOW_LOW) {
+			dev->flow_held = false;
+			dev->io->set_clock_1();
+		}
+	} else {
+		dev->flow_wanted = in >= PS2_FLOW_HIGH || out >= PS2_FLOW_HIGH;
+		if (dev->flow_wanted && dev->tx_state == TX_IDLE && !dev->input_bits && dev->io->get_clock()) {
+			flow_hold(dev);	// between frames, nothing is cut short
+		}
+	}
+	hal_irq_enable();
+}
+
+static bool request_to_send(PS2IF *dev, uint8_t c, bool force)
 {
 	uint16_t d = c;
 	if (!(countbits(d) & 1)) d |= 0x100;	// make odd parity
@@ -61,24 +134,84 @@ bool ps2d_next_output(PS2IF *dev, uint8_t c)
 	//          ^           stop bit
 	//         ^            reply from keyboard (ack bit)
 	//
-	cli();
-	if (dev->input_bits) {
-		sei();
+	hal_irq_disable();
+	if ((!dev->io->get_clock() && !dev->flow_held) || (dev->input_bits && !force)) {	// our edge would be lost
+		hal_irq_enable();
 		return false;
 	}
+	if (dev->flow_held) {
+		dev->flow_held = false;	// the request to send holds the clock now
+		d >>= 1;	// no edge of ours, the start bit is out already
+	}
+	dev->input_bits = 0;	// the keyboard aborts this frame and repeats it
 	dev->output_bits = d;
+	dev->tx_acked = false;
 	dev->io->set_clock_0();	// I/O inhibit, trigger interrupt
 	dev->io->set_data_0();	// start bit
-	sei();
-	wait_40us();
-	wait_40us();
-	dev->io->set_clock_1();
-
-	dev->timeout = 0;
+	hal_irq_enable();	// intr() takes our own edge here
 
+	hal_irq_disable();
+	dev->watchdog_laps = PS2_RTS_LAPS;	// not the bit timeout while we hold the clock
+	hal_timeout_arm(PS2_LAP);
+	hal_irq_enable();
 	return true;
 }
 
+void ps2d_poll_output(PS2IF *dev)
+{
+	uint32_t now = micros();
+	uint8_t edges = dev->edges;
+	if (edges != dev->tx_edges) {	// bus activity since the last pass
+		dev->tx_edges = edges;
+		dev->idle_since = now;
+	}
+
+	switch (dev->tx_state) {
+	case TX_IDLE: {
+		int c = qget(&dev->output_queue);
+		if (c < 0) c = qget(&dev->inject_queue);
+		if (c < 0) return;
+		dev->tx_byte = c;
+		dev->tx_retries = 0;
+		dev->tx_at = now;
+		dev->tx_state = TX_WAIT;
+	}
+		// fall through
+	case TX_WAIT: {
+		bool force = now - dev->tx_at >= PS2_TX_PATIENCE;
+		if (now - dev->idle_since < PS2_IDLE_TIME && !force) return;
+		if (!request_to_send(dev, dev->tx_byte, force)) return;
+		dev->tx_at = now;
+		dev->tx_state = TX_INHIBIT;
+		return;
+	}
+	case TX_INHIBIT:
+		if (now - dev->tx_at < PS2_INHIBIT_TIME) return;
+		hal_irq_disable();
+		dev->io->set_clock_1();
+		dev->watchdog_laps = PS2_RTS_LAPS;
+		hal_timeout_arm(PS2_LAP);
+		hal_irq_enable();
+		dev->tx_state = TX_SENDING;
+		return;
+	case TX_SENDING:
+		if (dev->output_bits) return;
+		if (dev->tx_acked || dev->tx_retries >= PS2_TX_RETRIES) {
+			dev->tx_state = TX_IDLE;	// done, or given up
+			return;
+		}
+		dev->tx_retries++;
+		dev->tx_at = now + ((uint32_t)PS2_BACKOFF << dev->tx_retries);
+		dev->tx_state = TX_BACKOFF;
+		return;
+	case TX_BACKOFF:
+		if ((int32_t)(now - dev->tx_at) < 0) return;
+		dev->tx_at = now;
+		dev->tx_state = TX_WAIT;
+		return;
+	}
+}
+
 bool pc_send(PS2IF *host, unsigned char c)
 {
 	unsigned char i;
@@ -96,13 +229,16 @@ bool pc_send(PS2IF *host, unsigned char c)
 		wait_15us();
 		if (!host->io->get_clock()) break;
 		host->io->set_clock_0();
-		wait_40us();
+		waitloop(host->clock_low);
 		host->io->set_clock_1();
-		wait_15us();
+		waitloop(host->clock_high - 15);
 	}
 	host->io->set_data_1();
 
-	return i == 11;
+	if (i != 11) return false;
+	host->last_sent = c;
+	host->sent++;
+	return true;
 }
 
 int pc_recv(PS2IF *host)
@@ -144,7 +280,7 @@ int pc_recv(PS2IF *host)
 	return bits & 0xff;
 }
 
-inline void pc_put(PS2IF *host, unsigned char c)
+void pc_put(PS2IF *host, uint8_t c)
 {
 	qput(&host->output_queue, c & 0xff);
 }
@@ -155,17 +291,26 @@ inline int pc_get(PS2IF *host)
 	return c;
 }
 
-inline void kb_put(PS2IF *dev, uint8_t c)
+// answer a resend (FE) from the PC with the last byte clocked out
+void pc_resend(PS2IF *host)
+{
+	qunget(&host->output_queue, host->last_sent);
+}
+
+void kb_put(PS2IF *dev, uint8_t c)
 {
 	qput(&dev->output_queue, c & 0xff);
 }
 
+// locally generated bytes, sent when no host command is waiting
+void kb_inject(PS2IF *dev, uint8_t c)
+{
+	qput(&dev->inject_queue, c & 0xff);
+}
+
 inline int kb_get(PS2IF *dev)
 {
-	int c;
-	cli();
-	c = qget(&dev->input_queue);
-	sei();
+	int c = qget(&dev->input_queue);
 	return c;
 }
 
@@ -173,15 +318,58 @@ inline int kb_get(PS2IF *dev)
 
 void intr(PS2IF *dev)
 {
-	if (dev->io->get_clock()) {
-		sei();
+	bool clock;
+	bool data;
+#ifdef DEGLITCH_ENABLED
+	uint16_t t = hal_cycles();
+	uint32_t us = micros();
+	bool recent = us - dev->edge_us < PS2_EDGE_AGE;
+	if (recent && (uint16_t)(t - dev->edge_at) < PS2_MIN_EDGE) {
+		dev->glitches++;	// ringing after the previous edge
+		return;
+	}
+	uint8_t c = dev->io->get_clock();
+	uint8_t d = dev->io->get_data();
+	for (uint8_t i = 0; i < 2; i++) {
+		waitloop(PS2_SAMPLE_SPACING);
+		c += dev->io->get_clock();
+		d += dev->io->get_data();
+	}
+	clock = c >= 2;
+	data = d >= 2;
+	if (clock == dev->clock_level) {
+		dev->glitches++;	// the clock is back where it was
+		return;
+	}
+	if (!clock && dev->input_bits && (!recent || (uint16_t)(t - dev->edge_at) > PS2_MAX_PHASE)) {
+		dev->errors++;	// an edge went missing, this is a start bit
+		dev->input_bits = 0;
+	}
+	dev->clock_level = clock;
+	dev->edge_at = t;
+	dev->edge_us = us;
+#else
+	clock = dev->io->get_clock();
+	data = dev->io->get_data();
+#endif
+	if (clock) {
+		hal_irq_enable();
+	} else if (dev->flow_held) {
+		// our own hold, see ps2d_flow()
 	} else {
-		dev->timeout = 10;	// 10ms
+		dev->edges++;
+#ifdef HOSTEMU_ENABLED
+		hostemu_edge(&hostemu, dev);
+#endif
+		dev->watchdog_laps = 0;
+		hal_timeout_arm(PS2_BIT_TIMEOUT);
 		if (!dev->input_bits) {
 			if (dev->output_bits) {			// transmit mode
 				if (dev->output_bits == 1) {
 					dev->output_bits = 0;		// end transmit
-					dev->timeout = 0;
+					dev->tx_acked = !data;
+					hal_timeout_cancel();
+					sched_post(SCHED_RELAY);
 				} else {
 					if (dev->output_bits & 1) {
 						dev->io->set_data_1();
@@ -196,37 +384,76 @@ void intr(PS2IF *dev)
 		}
 		if (dev->input_bits) {
 			dev->input_bits >>= 1;
-			if (dev->io->get_data()) {
+			if (data) {
 				dev->input_bits |= 0x800;
 			}
 			if (dev->input_bits & 1) {
+				bool ok = false;
 				if (dev->input_bits & 0x800) {				// stop bit ?
 					if (countbits(dev->input_bits & 0x7fc) & 1) {	// odd parity ?
 						uint8_t c = (dev->input_bits >> 2) & 0xff;
 						qput(&dev->input_queue, c);
+						sched_post(SCHED_RELAY);
+						if ((dev->flow_wanted || dev->input_queue.len >= PS2_FLOW_HIGH) && !dev->flow_held) {
+							flow_hold(dev);	// the frame is complete, hold the next one
+						}
+						ok = true;
 					}
 				}
+				if (!ok) dev->errors++;
 				dev->input_bits = 0;
-				dev->timeout = 0;
+				hal_timeout_cancel();
 			}
 		}
 	}
 }
 
+// the next clock edge is overdue
+
+void watchdog(PS2IF *dev)
+{
+	if (dev->watchdog_laps > 0) {
+		dev->watchdog_laps--;
+		hal_timeout_arm(PS2_LAP);
+		return;
+	}
+	dev->output_bits = 0;
+	dev->input_bits = 0;
+	dev->io->set_data_1();
+	dev->io->set_clock_1();
+	dev->errors++;
+	sched_post(SCHED_RELAY);
+}
+
 ISR(INT0_vect)
 {
+	PROFILE_ISR_ENTER();
+#ifdef TIMING_ENABLED
+	timing_edge(&timing.kb, !kb0_get_clock(), kb0_clock_driven(), kb0_get_data());
+#endif
 	intr(&ps2d);
+	PROFILE_ISR_EXIT(PROFILE_INT0);
+}
+
+ISR(TIMER1_COMPA_vect)
+{
+	PROFILE_ISR_ENTER();
+	watchdog(&ps2d);
+	PROFILE_ISR_EXIT(PROFILE_TIMER1);
 }
 
 ISR(INT5_vect)
 {
+	PROFILE_ISR_ENTER();
+#ifdef TIMING_ENABLED
+	timing_edge(&timing.pc, !pc_get_clock(), !pc_clock_driven(), pc_get_data());
+#endif
+	sched_post(SCHED_RELAY);	// the PC may want to send
+	PROFILE_ISR_EXIT(PROFILE_INT5);
 }
 
 //
 
-void report_host_to_device(uint8_t c);
-void report_device_to_host(uint8_t c);
-
 void ps2_io_handler(PS2IF *host, PS2IF *dev)
 {
 	int c;
@@ -236,65 +463,147 @@ void ps2_io_handler(PS2IF *host, PS2IF *dev)
 	if (c >= 0) {
 		qput(&host->input_queue, c);
 	}
+	hal_preempt_point();
 
-	// transmit to host
-	c = qget(&host->output_queue);
+	// transmit to host, the byte stays queued until it is through
+	c = qpeek(&host->output_queue);
 	if (c >= 0) {
-		if (!pc_send(host, c)) {
-			qunget(&host->output_queue, c);
+		if (pc_send(host, c)) {
+			qget(&host->output_queue);
+			host->inhibited = false;
+		} else {
+			if (!host->inhibited) host->inhibits++;	// once per hold
+			host->inhibited = true;
 		}
 	}
+	hal_preempt_point();
 
 	// transmit to device
-	c = qget(&dev->output_queue);
-	if (c >= 0) {
-		if (!ps2d_next_output(dev, c)) {
-			qunget(&dev->output_queue, c);
-		}
-	}
+	ps2d_flow(host, dev);
+	ps2d_poll_output(dev);
+}
+
+// keyboard byte on its way to the PC, after the remap stage
+static void relay_to_pc(PS2IF *host, uint8_t c)
+{
+#ifdef TRANSLATE_ENABLED
+	int t = translate_byte(&translate, c);
+	if (t >= 0) pc_put(host, t);
+#else
+	pc_put(host, c);
+#endif
 }
 
 void ps2_handler(PS2IF *host, PS2IF *dev, bool timer_event_flag)
 {
+	(void)timer_event_flag;	// only the optional stages below use it
 	int c;
 
-	if (timer_event_flag) {
-
-		cli();
-		if (dev->timeout > 0) {
-			if (dev->timeout > 1) {
-				dev->timeout--;
-			} else {
-				dev->output_bits = 0;
-				dev->input_bits = 0;
-				dev->io->set_data_1();
-				dev->io->set_clock_1();
-				dev->timeout = 0;
-			}
-		}
-		sei();
-	}
-
 	c = pc_get(host);
 	if (c >= 0) {
+#ifdef GENERATOR_ENABLED
+		if (generator_host_byte(&generator, c)) {
+			// answered by the generator
+		} else
+#endif
+#ifdef HOSTEMU_ENABLED
+		if (hostemu.active) {
+			// the keyboard is ours while benchmarking
+		} else
+#endif
+#ifdef SHADOW_ENABLED
+		shadow_host_byte(&ps2_shadow, host, c);
+#else
 		kb_put(dev, c);
+#endif
+#ifdef KEYSTATE_ENABLED
+		keystate_host_byte(&keystate, c);
+#endif
+#ifdef REMAP_ENABLED
+		remap_host_byte(&remap, c);
+#endif
 		report_host_to_device(c);
 	}
+	hal_preempt_point();
 	c = kb_get(dev);
 	if (c >= 0) {
-		pc_put(host, c);
+#ifdef GENERATOR_ENABLED
+		if (generator.mode == GENERATOR_OFF)
+#endif
+#ifdef HOSTEMU_ENABLED
+		if (!hostemu_device_byte(&hostemu, c))
+#endif
+#ifdef SHADOW_ENABLED
+		if (!shadow_device_byte(&ps2_shadow, dev, c))
+#endif
+		{
+#ifdef REMAP_ENABLED
+			uint8_t out[3];
+			uint8_t n = remap_device_byte(&remap, c, out);
+			for (uint8_t i = 0; i < n; i++) {
+				relay_to_pc(host, out[i]);
+			}
+#else
+			relay_to_pc(host, c);
+#endif
+		}
+#ifdef KEYSTATE_ENABLED
+		keystate_device_byte(&keystate, c);
+#endif
 		report_device_to_host(c);
 	}
+#ifdef SHADOW_ENABLED
+	shadow_poll(&ps2_shadow, dev, timer_event_flag);
+#endif
+#ifdef KEYSTATE_ENABLED
+	keystate_poll(&keystate, timer_event_flag);
+#endif
+#ifdef GENERATOR_ENABLED
+	generator_poll(&generator, timer_event_flag);
+#endif
+#ifdef HOSTEMU_ENABLED
+	hostemu_poll(&hostemu);
+#endif
+#ifdef TIMING_ENABLED
+	timing_poll(&timing, timer_event_flag);
+#endif
 }
 
+// queue reserves in blocks of the shared arena (queue.h); the input
+// reserve covers the flow control mark with room for the frames that
+// are on their way before the hold
+#define PS2_INPUT_RESERVE 2	// 16 bytes
+#define PS2_OUTPUT_RESERVE 1
+#define PS2_QUEUE_LIMIT 128	// bytes, more than the arena can give
+
 void init_device(PS2IF *dev)
 {
-	qinit(&dev->event_queue_l);
-	qinit(&dev->event_queue_h);
-	qinit(&dev->output_queue);
-	qinit(&dev->input_queue);
+	queue_init(&dev->output_queue, PS2_OUTPUT_RESERVE, PS2_QUEUE_LIMIT);
+	queue_init(&dev->inject_queue, 0, PS2_QUEUE_LIMIT);
+	queue_init(&dev->input_queue, PS2_INPUT_RESERVE, PS2_QUEUE_LIMIT);
 	dev->output_bits = 0;
 	dev->input_bits = 0;
+	dev->watchdog_laps = 0;
+	dev->errors = 0;
+	dev->edges = 0;
+	dev->tx_state = TX_IDLE;
+	dev->tx_edges = 0;
+	dev->idle_since = micros();
+	dev->clock_low = PS2_CLOCK_LOW;
+	dev->clock_high = PS2_CLOCK_HIGH;
+	dev->last_sent = 0xaa;
+	dev->inhibited = false;
+	dev->sent = 0;
+	dev->inhibits = 0;
+	dev->flow_held = false;
+	dev->flow_wanted = false;
+	dev->flow_holds = 0;
+#ifdef DEGLITCH_ENABLED
+	dev->edge_at = hal_cycles() - PS2_MIN_EDGE;
+	dev->edge_us = micros() - PS2_EDGE_AGE;
+	dev->clock_level = true;
+	dev->glitches = 0;
+#endif
 }
 
 void init_as_ps2_device(PS2IF *d)
@@ -317,28 +626,56 @@ void keyboard_setup()
 	ps2d.io = &ps2d_io;
 	ps2h.io = &ps2h_io;
 
-	PORTD = 0;
-	DDRD = 0xaa;
-
-	EIMSK |= 0x21;
-	EICRA = 0x01;
-	EICRB = 0x04;
+	ps2if_init();
+	hal_timeout_init();
+	queue_arena_init();
 
 	init_as_ps2_host(&ps2h);
 	init_as_ps2_device(&ps2d);
+#ifdef SHADOW_ENABLED
+	shadow_init(&ps2_shadow);
+#endif
+#ifdef KEYSTATE_ENABLED
+	keystate_init(&keystate);
+#endif
+#ifdef TRANSLATE_ENABLED
+	translate_init(&translate);
+#endif
+#ifdef REMAP_ENABLED
+	remap_init(&remap);
+#endif
+#ifdef HOSTEMU_ENABLED
+	hostemu_init(&hostemu);
+#endif
+#ifdef TIMING_ENABLED
+	timing_init(&timing);
+#endif
 }
 
 void ps2_loop()
 {
-	cli();
+	hal_irq_disable();
 	bool timerevent = interval_1ms_flag;
 	interval_1ms_flag = false;
-	sei();
+	hal_irq_enable();
 
 	ps2_io_handler(&ps2h, &ps2d);
 	ps2_handler(&ps2h, &ps2d, timerevent);
 }
 
+// nothing queued and no frame in flight on either port, the relay can
+// wait for the next interrupt
+bool ps2_idle()
+{
+	uint8_t sreg = hal_irq_save();
+	bool idle = !ps2d.input_queue.len && !ps2d.output_queue.len && !ps2d.inject_queue.len
+		&& !ps2h.input_queue.len && !ps2h.output_queue.len
+		&& ps2d.tx_state == TX_IDLE && !ps2d.input_bits && !ps2d.output_bits && !ps2d.flow_held
+		&& !ps2h.input_bits && !ps2h.output_bits;
+	hal_irq_restore(sreg);
+	return idle;
+}
+
 
 
 
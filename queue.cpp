@@ -0,0 +1,181 @@
+#include "queue.h"
+#include "hal.h"
+
+QueueArena queue_arena;
+
+void queue_arena_init()
+{
+	QueueArena *a = &queue_arena;
+	for (uint8_t i = 0; i < QUEUE_BLOCKS; i++) {
+		a->next[i] = i + 1 < QUEUE_BLOCKS ? i + 1 : QUEUE_NONE;
+	}
+	a->free = 0;
+	a->nfree = QUEUE_BLOCKS;
+	a->owed = 0;
+	a->low = QUEUE_BLOCKS;
+}
+
+void queue_init(Queue *q, uint8_t reserve, uint8_t limit)
+{
+	uint8_t sreg = hal_irq_save();
+	q->head = QUEUE_NONE;
+	q->tail = QUEUE_NONE;
+	q->pos = 0;
+	q->len = 0;
+	q->blocks = 0;
+	q->reserve = reserve;
+	q->limit = limit;
+	queue_arena.owed += reserve;
+	hal_irq_restore(sreg);
+	queue_clear_stats(q);
+}
+
+// a block for q, its own reserve first
+static uint8_t take(Queue *q)
+{
+	QueueArena *a = &queue_arena;
+	if (q->blocks < q->reserve) {
+		a->owed--;
+	} else if (a->nfree <= a->owed) {
+		return QUEUE_NONE;	// the rest is promised
+	}
+	uint8_t b = a->free;
+	a->free = a->next[b];
+	if (--a->nfree < a->low) a->low = a->nfree;
+	if (++q->blocks > q->reserve && q->blocks - q->reserve > q->borrowed) {
+		q->borrowed = q->blocks - q->reserve;
+	}
+	return b;
+}
+
+static void give(Queue *q, uint8_t b)
+{
+	QueueArena *a = &queue_arena;
+	a->next[b] = a->free;
+	a->free = b;
+	a->nfree++;
+	if (--q->blocks < q->reserve) a->owed++;
+}
+
+void queue_clear(Queue *q)
+{
+	uint8_t sreg = hal_irq_save();
+	while (q->blocks) {
+		uint8_t b = q->head;
+		q->head = queue_arena.next[b];
+		give(q, b);
+	}
+	q->head = QUEUE_NONE;
+	q->tail = QUEUE_NONE;
+	q->pos = 0;
+	q->len = 0;
+	hal_irq_restore(sreg);
+}
+
+int queue_peek(Queue *q)
+{
+	uint8_t sreg = hal_irq_save();
+	int c = q->len > 0 ? queue_arena.data[q->head][q->pos] : -1;
+	hal_irq_restore(sreg);
+	return c;
+}
+
+int queue_get(Queue *q)
+{
+	uint8_t sreg = hal_irq_save();
+	int c = -1;
+	if (q->len > 0) {
+		c = queue_arena.data[q->head][q->pos];
+		q->len--;
+		if (++q->pos == QUEUE_BLOCK || q->len == 0) {
+			uint8_t b = q->head;
+			q->head = q->len ? queue_arena.next[b] : QUEUE_NONE;
+			q->pos = 0;
+			give(q, b);
+		}
+	}
+	hal_irq_restore(sreg);
+	return c;
+}
+
+static void count(Queue *q, bool ok)
+{
+	if (!ok) {
+		q->drops++;
+	} else if (++q->len > q->peak) {
+		q->peak = q->len;
+	}
+}
+
+bool queue_put(Queue *q, uint8_t c)
+{
+	uint8_t sreg = hal_irq_save();
+	bool ok = q->len < q->limit;
+	if (ok) {
+		uint8_t at = q->blocks ? q->pos + q->len - (q->blocks - 1) * QUEUE_BLOCK : QUEUE_BLOCK;
+		if (at == QUEUE_BLOCK) {
+			uint8_t b = take(q);
+			if (b == QUEUE_NONE) {
+				ok = false;
+			} else {
+				if (q->blocks == 1) {
+					q->head = b;
+				} else {
+					queue_arena.next[q->tail] = b;
+				}
+				q->tail = b;
+				at = 0;
+			}
+		}
+		if (ok) queue_arena.data[q->tail][at] = c;
+	}
+	count(q, ok);
+	hal_irq_restore(sreg);
+	return ok;
+}
+
+bool queue_unget(Queue *q, uint8_t c)
+{
+	uint8_t sreg = hal_irq_save();
+	bool ok = q->len < q->limit;
+	if (ok && q->pos == 0) {
+		uint8_t b = take(q);
+		if (b == QUEUE_NONE) {
+			ok = false;
+		} else {
+			if (q->blocks == 1) {
+				q->tail = b;
+			} else {
+				queue_arena.next[b] = q->head;
+			}
+			q->head = b;
+			q->pos = QUEUE_BLOCK;
+		}
+	}
+	if (ok) queue_arena.data[q->head][--q->pos] = c;
+	count(q, ok);
+	hal_irq_restore(sreg);
+	return ok;
+}
+
+uint8_t queue_room(Queue *q)
+{
+	QueueArena *a = &queue_arena;
+	uint8_t sreg = hal_irq_save();
+	uint8_t blocks = a->nfree > a->owed ? a->nfree - a->owed : 0;
+	if (q->blocks < q->reserve) blocks += q->reserve - q->blocks;
+	uint16_t n = (uint16_t)blocks * QUEUE_BLOCK;
+	if (q->blocks) n += q->blocks * QUEUE_BLOCK - q->pos - q->len;	// rest of the tail
+	if (n > q->limit - q->len) n = q->limit - q->len;
+	hal_irq_restore(sreg);
+	return n;
+}
+
+void queue_clear_stats(Queue *q)
+{
+	uint8_t sreg = hal_irq_save();
+	q->peak = q->len;
+	q->borrowed = q->blocks > q->reserve ? q->blocks - q->reserve : 0;
+	q->drops = 0;
+	hal_irq_restore(sreg);
+}
@@ -0,0 +1,59 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stdint.h>
+
+// byte queues on a shared block arena
+//
+// The relay queues take their storage from one pool of QUEUE_BLOCKS
+// blocks of QUEUE_BLOCK bytes. A queue holds a chain of blocks and gives
+// each one back as soon as it is read out. Every queue is promised its
+// `reserve` blocks, which nobody else can take; beyond that it borrows
+// what is free and not promised to another queue, up to `limit` bytes.
+// A channel in a burst runs deep on the memory of the idle ones, and an
+// idle channel still finds its reserve when it wakes up. A byte without
+// room is counted in `drops`.
+//
+// The functions run with interrupts off, intr() fills a queue from the
+// keyboard clock interrupt while the main loop works on the others.
+
+#define QUEUE_BLOCK 8		// bytes
+#define QUEUE_BLOCKS 16
+#define QUEUE_NONE 0xff
+
+struct Queue {
+	uint8_t head;		// block read from, QUEUE_NONE while empty
+	uint8_t tail;		// block written to
+	uint8_t pos;		// read offset in head
+	uint8_t len;		// bytes
+	uint8_t blocks;		// held
+	uint8_t reserve;	// blocks promised
+	uint8_t limit;		// bytes at most
+	// statistics, see queue_clear_stats()
+	uint8_t peak;		// the most bytes held
+	uint8_t borrowed;	// the most blocks held beyond the reserve
+	uint16_t drops;
+};
+
+struct QueueArena {
+	uint8_t next[QUEUE_BLOCKS];	// chain of a queue, or of the free blocks
+	uint8_t data[QUEUE_BLOCKS][QUEUE_BLOCK];
+	uint8_t free;		// first free block
+	uint8_t nfree;
+	uint8_t owed;		// promised blocks not taken yet
+	uint8_t low;		// the fewest free blocks seen
+};
+
+extern QueueArena queue_arena;
+
+void queue_arena_init();	// before any queue_init(), drops all queues
+void queue_init(Queue *q, uint8_t reserve, uint8_t limit);
+void queue_clear(Queue *q);	// give back all blocks, keep the reserve
+int queue_peek(Queue *q);
+int queue_get(Queue *q);
+bool queue_put(Queue *q, uint8_t c);
+bool queue_unget(Queue *q, uint8_t c);	// in front of the others
+uint8_t queue_room(Queue *q);	// bytes a queue_put() loop gets in now
+void queue_clear_stats(Queue *q);
+
+#endif
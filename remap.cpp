@@ -0,0 +1,108 @@
+#include "remap.h"
+
+#ifdef REMAP_ENABLED
+
+#include "hal.h"
+#include "ps2.h"
+
+Remap remap;
+
+#define REMAP_CASE(from, to) k == (from) ? (to) :
+
+static constexpr uint8_t remap_key(uint8_t k)
+{
+	return REMAP_LIST(REMAP_CASE) k;
+}
+
+#define REMAP_ROW(b) \
+	remap_key(b + 0x0), remap_key(b + 0x1), remap_key(b + 0x2), remap_key(b + 0x3), \
+	remap_key(b + 0x4), remap_key(b + 0x5), remap_key(b + 0x6), remap_key(b + 0x7), \
+	remap_key(b + 0x8), remap_key(b + 0x9), remap_key(b + 0xa), remap_key(b + 0xb), \
+	remap_key(b + 0xc), remap_key(b + 0xd), remap_key(b + 0xe), remap_key(b + 0xf)
+
+static const uint8_t remap_table[256] PROGMEM = {
+	REMAP_ROW(0x00), REMAP_ROW(0x10), REMAP_ROW(0x20), REMAP_ROW(0x30),
+	REMAP_ROW(0x40), REMAP_ROW(0x50), REMAP_ROW(0x60), REMAP_ROW(0x70),
+	REMAP_ROW(0x80), REMAP_ROW(0x90), REMAP_ROW(0xa0), REMAP_ROW(0xb0),
+	REMAP_ROW(0xc0), REMAP_ROW(0xd0), REMAP_ROW(0xe0), REMAP_ROW(0xf0),
+};
+
+void remap_init(Remap *r)
+{
+	remap_enable(r, false);
+	r->command = 0;
+	r->expect = 0;
+	r->eeprom = eeprom_read_byte((uint8_t const *)REMAP_EEPROM_ADDR) == REMAP_EEPROM_MAGIC;
+}
+
+void remap_enable(Remap *r, bool enabled)
+{
+	r->enabled = enabled;
+	r->decoder = 0;
+	r->nheld = 0;
+	r->response = 0;
+}
+
+void remap_host_byte(Remap *r, uint8_t c)
+{
+	if (c == 0xf2) {
+		r->expect = 2;	// read ID: AB 83
+	} else if (r->command == 0xf0 && c == 0) {
+		r->expect = 1;	// get scan set: 01, 02 or 03
+	} else {
+		r->expect = 0;
+	}
+	r->command = c;
+}
+
+// c unchanged, after the prefixes held for it
+static uint8_t pass(Remap *r, uint8_t c, uint8_t *out)
+{
+	uint8_t n = 0;
+	for (uint8_t i = 0; i < r->nheld; i++) {
+		out[n++] = r->held[i];
+	}
+	r->nheld = 0;
+	out[n++] = c;
+	return n;
+}
+
+uint8_t remap_device_byte(Remap *r, uint8_t c, uint8_t *out)
+{
+	if (!r->enabled) {
+		out[0] = c;
+		return 1;
+	}
+	if (r->response) {
+		r->response--;
+		r->decoder = 0;
+		return pass(r, c, out);
+	}
+	if (c == 0xfa) {	// ACK, the data of the response follows
+		r->response = r->expect;
+		r->expect = 0;
+	}
+	uint16_t ev = ps2decode(&r->decoder, c);
+	if (ev == PS2_EVENT_NONE) {	// prefix, sent with the key
+		if (r->nheld < sizeof(r->held)) r->held[r->nheld++] = c;
+		return 0;
+	}
+	if (ev & PS2_EVENT_RAW) return pass(r, c, out);
+	r->nheld = 0;
+	uint8_t k = ev & 0xff;
+	if (r->eeprom) {
+		k = eeprom_read_byte((uint8_t const *)(REMAP_EEPROM_ADDR + 1) + k);
+	} else {
+		k = pgm_read_byte(&remap_table[k]);
+	}
+	uint8_t n = 0;
+	if ((k & 0x80) && k != 0x83 && k != 0x84) {	// 83 (F7) and 84 (SysRq) have no E0
+		out[n++] = 0xe0;
+		k &= 0x7f;
+	}
+	if (ev & PS2_EVENT_BREAK) out[n++] = 0xf0;
+	out[n++] = k;
+	return n;
+}
+
+#endif // REMAP_ENABLED
@@ -0,0 +1,52 @@
+#ifndef REMAP_H
+#define REMAP_H
+
+#include <stdint.h>
+
+//#define REMAP_ENABLED
+
+#ifdef REMAP_ENABLED
+
+// key remapping on the keyboard to PC relay
+//
+// Bytes from the keyboard are decoded with ps2decode(), the key index is
+// looked up in a 256-entry table and the event is encoded back to set 2
+// (E0 and F0 prefixes as needed). Responses and the pause sequence pass
+// unchanged, with any prefix held for them. The data bytes of a command
+// response (the ID after F2, the scan set after F0 00) look like key
+// codes: after the ACK of such a command they pass unchanged too. Runs
+// before the set 1 translation, off until the 'M' command.
+//
+// The table is built at compile time from REMAP_LIST. If the EEPROM
+// starts with REMAP_EEPROM_MAGIC, the 256 bytes after it replace the
+// table at run time (entry i is the key index sent for key index i).
+
+// REMAP(from, to): key indexes as returned by ps2decode(), the set 2
+// code, or 0x80 | code for E0 keys
+#define REMAP_LIST(REMAP) \
+	REMAP(0x58, 0x14)	/* Caps Lock -> left Ctrl */
+
+#define REMAP_EEPROM_MAGIC 0xa5
+#define REMAP_EEPROM_ADDR 0	// magic, then the table
+
+struct Remap {
+	uint8_t enabled;
+	uint8_t decoder;	// ps2decode() state
+	uint8_t held[2];	// prefixes the decoder has taken
+	uint8_t nheld;
+	uint8_t command;	// last byte from the host
+	uint8_t expect;		// data bytes after the ACK of that command
+	uint8_t response;	// data bytes still to pass unchanged
+	uint8_t eeprom;		// use the EEPROM table
+};
+
+extern Remap remap;
+
+void remap_init(Remap *r);
+void remap_enable(Remap *r, bool enabled);
+void remap_host_byte(Remap *r, uint8_t c);
+uint8_t remap_device_byte(Remap *r, uint8_t c, uint8_t *out);	// bytes in out[3]
+
+#endif // REMAP_ENABLED
+
+#endif // REMAP_H
@@ -0,0 +1,69 @@
+#include "replay.h"
+
+#ifdef REPLAY_ENABLED
+
+#include "cdc.h"
+#include "hal.h"
+#include "ps2if.h"
+#include "report.h"
+
+Replay replay;
+
+void replay_start(Replay *r)
+{
+	r->active = 1;
+	r->loaded = 0;
+	r->records = 0;
+	r->late_max = 0;
+	r->waiting = micros();
+}
+
+static void replay_end(Replay *r, bool timeout)
+{
+	r->active = 0;
+	print("Y ");
+	print_dec(r->records);
+	print(" late ");
+	print_dec(r->late_max);
+	if (timeout) print(" timeout");
+	print_crlf();
+}
+
+bool replay_poll(Replay *r)
+{
+	if (!r->loaded) {
+		if (usb_read_available() < 4) {
+			if (micros() - r->waiting >= REPLAY_TIMEOUT) {
+				while (usb_read_available() > 0) {
+					usb_read_byte();
+				}
+				replay_end(r, true);
+			}
+			return false;
+		}
+		for (uint8_t i = 0; i < 4; i++) {
+			r->rec[i] = usb_read_byte();
+		}
+		if (r->records == 0) {
+			r->due = micros();	// the schedule starts with the first record
+		}
+		r->due += r->rec[2] | (unsigned)r->rec[3] << 8;
+		r->loaded = 1;
+	}
+
+	uint32_t now = micros();
+	uint32_t late = now - r->due;
+	if ((int32_t)late < 0) return true;
+	if (late > r->late_max) r->late_max = late;
+	r->loaded = 0;
+	r->records++;
+	r->waiting = now;
+
+	uint8_t flags = r->rec[0];
+	if (flags & REPLAY_TO_PC) pc_put(&ps2h, r->rec[1]);
+	if (flags & REPLAY_TO_KB) kb_put(&ps2d, r->rec[1]);
+	if (flags & REPLAY_END) replay_end(r, false);
+	return r->active;	// the next record may be in already
+}
+
+#endif // REPLAY_ENABLED
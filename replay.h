@@ -0,0 +1,60 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdint.h>
+
+//#define REPLAY_ENABLED
+
+#ifdef REPLAY_ENABLED
+
+// capture replay from the CDC host
+//
+// The 'Y' command switches the CDC input from commands to replay records
+// of 4 bytes:
+//
+//  flags, byte, delta (us after the previous record, little endian)
+//
+// REPLAY_TO_PC queues the byte toward the PC with pc_put(), REPLAY_TO_KB
+// toward the keyboard with kb_put(). A record with neither is a pure
+// delay, to chain gaps longer than 65 ms. REPLAY_END goes back to
+// command mode and reports
+//
+//  Y <records> late <us>
+//
+// with the worst lateness against the recorded schedule. Every record is
+// due at the due time of the previous one plus its delta, so lateness
+// does not add up over a long capture. Records are read only once the
+// previous one went out; the following ones wait in the CDC RX ring and
+// the endpoint banks, and the USB host is NAKed meanwhile, so a capture
+// can be longer than RAM.
+//
+// An upload cut short would leave the commands dead: without a complete
+// record for REPLAY_TIMEOUT ms the replay ends as well, the bytes of a
+// partial record are dropped and the report line ends in " timeout".
+
+#define REPLAY_TIMEOUT 1000000UL	// us
+
+enum {
+	REPLAY_TO_PC = 0x01,
+	REPLAY_TO_KB = 0x02,
+	REPLAY_END = 0x80,
+};
+
+struct Replay {
+	uint8_t active;
+	uint8_t loaded;		// rec holds the next record
+	uint8_t rec[4];
+	uint32_t due;		// us
+	uint32_t waiting;	// us, since the previous record went out
+	uint16_t records;
+	uint32_t late_max;	// us
+};
+
+extern Replay replay;
+
+void replay_start(Replay *r);
+bool replay_poll(Replay *r);	// false: waiting for the host, nothing due
+
+#endif // REPLAY_ENABLED
+
+#endif // REPLAY_H
@@ -0,0 +1,480 @@
+
+#include "report.h"
+#include "cdc.h"
+#include "hal.h"
+#include "keystate.h"
+#include "mouse.h"
+#include "profile.h"
+#include "ps2if.h"
+#include "translate.h"
+#include "remap.h"
+#include "sched.h"
+#include "shadow.h"
+#include "replay.h"
+#include "generator.h"
+#include "hostemu.h"
+#include "timing.h"
+#include <string.h>
+
+// line records
+//
+// Every log line is one record in the CDC TX ring. The first print of a
+// line reserves REPORT_LINE_RESERVE contiguous bytes, the print functions
+// format straight into them and print_crlf() commits what was written.
+// A longer line moves to a REPORT_LINE_MAX reservation. If the ring has
+// no room, the line goes to a scratch buffer and is dropped whole, so the
+// host never sees a partial line. Text beyond REPORT_LINE_MAX is cut off.
+
+#define REPORT_LINE_RESERVE 40	// any byte log line
+#define REPORT_LINE_MAX 80	// a key state snapshot
+
+static uint8_t line_scratch[REPORT_LINE_MAX];
+static uint8_t *line;	// current line, nullptr between lines
+static uint8_t line_n;
+static uint8_t line_size;
+
+// len more bytes at the end of the current line, nullptr if it would get
+// longer than REPORT_LINE_MAX
+static uint8_t *line_append(uint8_t len)
+{
+	if (!line) {
+		line_n = 0;
+		line_size = 0;
+	}
+	uint8_t need = line_n + len + 2;	// always room for CR LF
+	if (need > line_size) {
+		if (need > REPORT_LINE_MAX) return nullptr;
+		uint8_t size = need > REPORT_LINE_RESERVE ? REPORT_LINE_MAX : REPORT_LINE_RESERVE;
+		uint8_t *p = usb_tx_reserve(size);	// same or a lower address
+		if (!p) {
+			p = line_scratch;
+			size = REPORT_LINE_MAX;
+		}
+		if (line_n > 0) memmove(p, line, line_n);
+		line = p;
+		line_size = size;
+	}
+	uint8_t *p = line + line_n;
+	line_n += len;
+	return p;
+}
+
+#define HEX_ROW(h) h "0" h "1" h "2" h "3" h "4" h "5" h "6" h "7" h "8" h "9" h "A" h "B" h "C" h "D" h "E" h "F"
+
+static const char hex_pairs[] PROGMEM =
+	HEX_ROW("0") HEX_ROW("1") HEX_ROW("2") HEX_ROW("3")
+	HEX_ROW("4") HEX_ROW("5") HEX_ROW("6") HEX_ROW("7")
+	HEX_ROW("8") HEX_ROW("9") HEX_ROW("A") HEX_ROW("B")
+	HEX_ROW("C") HEX_ROW("D") HEX_ROW("E") HEX_ROW("F");
+
+void print(char const *p)
+{
+	uint8_t n = 0;
+	while (p[n] && n < REPORT_LINE_MAX) {
+		n++;
+	}
+	uint8_t *q = line_append(n);
+	if (!q) {	// cut off, the reservation grows to REPORT_LINE_MAX
+		n = REPORT_LINE_MAX - 2 - (line ? line_n : 0);
+		q = line_append(n);
+	}
+	memcpy(q, p, n);
+}
+
+void print_hex(uint8_t c)
+{
+	uint8_t *q = line_append(2);
+	if (!q) return;
+	q[0] = pgm_read_byte(hex_pairs + c * 2);
+	q[1] = pgm_read_byte(hex_pairs + c * 2 + 1);
+}
+
+void print_crlf()
+{
+	uint8_t *q = line_append(0);
+	q[0] = '\r';
+	q[1] = '\n';
+	line_n += 2;
+	if (line == line_scratch) {
+		data_tx_dropped += line_n;
+	} else {
+		usb_tx_commit(line_n);
+	}
+	line = nullptr;
+}
+
+// reports of several lines print one line per pass while this holds,
+// instead of losing the lines that do not fit at once
+bool print_ready()
+{
+	return line || usb_tx_reserve(REPORT_LINE_MAX);
+}
+
+void report_lines(uint8_t *next, bool (*line)(void *ctx, uint8_t i), void *ctx)
+{
+	while (*next && print_ready()) {
+		uint8_t i = *next - 1;
+		bool more = line(ctx, i);
+		print_crlf();
+		*next = more ? i + 2 : 0;
+	}
+}
+
+void print_dec(uint32_t v)
+{
+	char tmp[11];
+	char *p = tmp + sizeof(tmp) - 1;
+	*p = 0;
+	do {
+		*--p = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	print(p);
+}
+
+// run-length stage
+//
+// Identical consecutive device-to-host units (a byte, or an E0 prefixed
+// pair) are logged once; the repeats are summarized by a single line
+//  H    <- xx D *<count> <duration>us
+// when a different byte arrives, the host sends something, or the run
+// is idle for RUNLENGTH_TIMEOUT ms.
+
+#define RUNLENGTH_TIMEOUT 1000000UL // us
+
+static struct {
+	bool enabled;
+	uint8_t prefix;	// E0 held until the following byte
+	uint16_t unit;	// 0xffff: no run
+	uint16_t count;	// repeats after the first occurrence
+	uint32_t first;
+	uint32_t last;
+} runlength = { false, 0, 0xffff, 0, 0, 0 };
+
+static void print_device_to_host(uint8_t c)
+{
+	print("H    <- ");
+	print_hex(c);
+	print(" D");
+}
+
+static void runlength_flush()
+{
+	if (runlength.prefix) {
+		print_device_to_host(runlength.prefix);
+		print_crlf();
+		runlength.prefix = 0;
+	}
+	if (runlength.count > 0) {
+		print_device_to_host(runlength.unit & 0xff);
+		print(" *");
+		print_dec(runlength.count);
+		print(" ");
+		print_dec(runlength.last - runlength.first);
+		print("us");
+		print_crlf();
+	}
+	runlength.unit = 0xffff;
+	runlength.count = 0;
+}
+
+static bool runlength_device_to_host(uint8_t c)
+{
+	if (!runlength.enabled) return false;
+
+	uint32_t now = micros();
+	if (c == 0xe0 && !runlength.prefix) {
+		runlength.prefix = c;
+		runlength.last = now;
+		return true;
+	}
+	uint16_t unit = (runlength.prefix << 8) | c;
+	if (unit == runlength.unit && runlength.count < 0xffff) {
+		runlength.prefix = 0;
+		runlength.count++;
+		runlength.last = now;
+		return true;
+	}
+	uint8_t prefix = runlength.prefix;
+	runlength.prefix = 0;
+	runlength_flush();
+	if (prefix) {
+		print_device_to_host(prefix);
+		print_crlf();
+	}
+	runlength.unit = unit;
+	runlength.first = now;
+	runlength.last = now;
+	return false;	// log the first occurrence as usual
+}
+
+static void runlength_poll()
+{
+	if (runlength.prefix || runlength.count > 0) {
+		if (micros() - runlength.last >= RUNLENGTH_TIMEOUT) {
+			runlength_flush();
+		}
+	}
+}
+
+void report_host_to_device(uint8_t c)
+{
+#ifdef MOUSE_ENABLED
+	mouse_flush(&mouse);
+	mouse_host_byte(&mouse, c);
+#endif
+	runlength_flush();
+	print("H ");
+	print_hex(c);
+	print(" ->    D");
+	print_crlf();
+
+}
+
+void report_device_to_host(uint8_t c)
+{
+#ifdef MOUSE_ENABLED
+	if (mouse_device_byte(&mouse, c)) return;
+#endif
+	if (runlength_device_to_host(c)) return;
+	print_device_to_host(c);
+	print_crlf();
+}
+
+// E <n> hold <n> [glitch <n>]
+static void report_errors()
+{
+	uint8_t sreg = hal_irq_save();
+	uint16_t n = ps2d.errors;
+	ps2d.errors = 0;
+	uint16_t h = ps2d.flow_holds;
+	ps2d.flow_holds = 0;
+#ifdef DEGLITCH_ENABLED
+	uint16_t g = ps2d.glitches;
+	ps2d.glitches = 0;
+#endif
+	hal_irq_restore(sreg);
+	print("E ");
+	print_dec(n);
+	print(" hold ");
+	print_dec(h);
+#ifdef DEGLITCH_ENABLED
+	print(" glitch ");
+	print_dec(g);
+#endif
+	print_crlf();
+}
+
+// Q <queue> <len> peak <n> blocks <n> borrowed <n> drops <n>
+// Q arena free <n> low <n> owed <n>
+//
+// One line per queue and one for the block arena (queue.h), paced by
+// print_ready(). Peaks, borrowing and drops are since the previous Q.
+
+static struct {
+	char const *name;
+	Queue *q;
+} const report_queues[] = {
+	{ "Q kb in ", &ps2d.input_queue },
+	{ "Q kb out ", &ps2d.output_queue },
+	{ "Q kb inject ", &ps2d.inject_queue },
+	{ "Q pc in ", &ps2h.input_queue },
+	{ "Q pc out ", &ps2h.output_queue },
+#ifdef SHADOW_ENABLED
+	{ "Q shadow ", &ps2_shadow.fwd_queue },
+#endif
+};
+
+#define REPORT_QUEUES (sizeof(report_queues) / sizeof(report_queues[0]))
+
+static uint8_t queue_report;	// next line, 1 based, 0: none
+
+static bool report_queue_line(void *, uint8_t i)
+{
+	if (i < REPORT_QUEUES) {
+		Queue *q = report_queues[i].q;
+		uint8_t sreg = hal_irq_save();
+		Queue copy = *q;
+		queue_clear_stats(q);
+		hal_irq_restore(sreg);
+		print(report_queues[i].name);
+		print_dec(copy.len);
+		print(" peak ");
+		print_dec(copy.peak);
+		print(" blocks ");
+		print_dec(copy.blocks);
+		print(" borrowed ");
+		print_dec(copy.borrowed);
+		print(" drops ");
+		print_dec(copy.drops);
+		return true;
+	}
+	uint8_t sreg = hal_irq_save();
+	QueueArena *a = &queue_arena;
+	uint8_t nfree = a->nfree;
+	uint8_t low = a->low;
+	uint8_t owed = a->owed;
+	a->low = nfree;
+	hal_irq_restore(sreg);
+	print("Q arena free ");
+	print_dec(nfree);
+	print(" low ");
+	print_dec(low);
+	print(" owed ");
+	print_dec(owed);
+	return false;
+}
+
+// single character commands from the CDC host
+//
+//  K   full key state snapshot
+//  s   key state snapshots on change
+//  S   key state snapshots every KEYSTATE_PERIOD ms
+//  n   no key state snapshots
+//  R   run-length stage on
+//  r   run-length stage off
+//  C   coalesce mouse movement while the USB host falls behind
+//  c   one line per mouse packet
+//  P   worst-case interrupt latency since the previous P
+//  E   keyboard frame errors, flow control holds (and glitches) since the previous E
+//  T   translate keyboard codes to set 1 toward the PC (8042 style)
+//  t   pass keyboard codes through untranslated
+//  M   key remapping on
+//  m   key remapping off
+//  Y   replay the capture that follows (see replay.h)
+//  G   generate a typematic flood toward the PC (see generator.h)
+//  A   generate all-keys rollover toward the PC
+//  W   generate a 200 Hz mouse stream toward the PC
+//  g   stop the generator
+//  B   benchmark the keyboard as its host (see hostemu.h)
+//  D   bus timing statistics since the previous D (see timing.h)
+//  F   PC side clock follows the keyboard clock
+//  f   PC side clock back to its fixed rate
+//  Q   queue and arena occupancy since the previous Q
+//  L   main loop task run times, deadline misses and idle sleep since the previous L
+void command_poll()
+{
+#ifdef REPLAY_ENABLED
+	if (replay.active) {
+		if (replay_poll(&replay)) {
+			sched_post(SCHED_USB_RX);	// records are due to the us, stay ready
+		}
+		return;
+	}
+#endif
+	if (usb_read_available() == 0) return;
+	switch (usb_read_byte()) {
+	case 'R':
+		runlength.enabled = true;
+		break;
+	case 'r':
+		runlength_flush();
+		runlength.enabled = false;
+		break;
+#ifdef MOUSE_ENABLED
+	case 'C':
+		mouse.coalesce = true;
+		break;
+	case 'c':
+		mouse_flush(&mouse);
+		mouse.coalesce = false;
+		break;
+#endif
+#ifdef KEYSTATE_ENABLED
+	case 'K':
+		keystate_snapshot(&keystate);
+		break;
+	case 's':
+		keystate_set_mode(&keystate, KEYSTATE_SNAPSHOT_ON_CHANGE);
+		break;
+	case 'S':
+		keystate_set_mode(&keystate, KEYSTATE_SNAPSHOT_PERIODIC);
+		break;
+	case 'n':
+		keystate_set_mode(&keystate, KEYSTATE_SNAPSHOT_OFF);
+		break;
+#endif
+#ifdef PROFILE_ENABLED
+	case 'P':
+		profile_report();
+		break;
+#endif
+	case 'E':
+		report_errors();
+		break;
+	case 'Q':
+		queue_report = 1;
+		break;
+	case 'L':
+		sched_report();
+		break;
+#ifdef TRANSLATE_ENABLED
+	case 'T':
+		translate_enable(&translate, true);
+		break;
+	case 't':
+		translate_enable(&translate, false);
+		break;
+#endif
+#ifdef REMAP_ENABLED
+	case 'M':
+		remap_enable(&remap, true);
+		break;
+	case 'm':
+		remap_enable(&remap, false);
+		break;
+#endif
+#ifdef REPLAY_ENABLED
+	case 'Y':
+		replay_start(&replay);
+		break;
+#endif
+#ifdef GENERATOR_ENABLED
+	case 'G':
+		generator_start(&generator, GENERATOR_TYPEMATIC);
+		break;
+	case 'A':
+		generator_start(&generator, GENERATOR_ROLLOVER);
+		break;
+	case 'W':
+		generator_start(&generator, GENERATOR_MOUSE);
+		break;
+	case 'g':
+		generator_stop(&generator);
+		break;
+#endif
+#ifdef HOSTEMU_ENABLED
+	case 'B':
+		hostemu_start(&hostemu);
+		break;
+#endif
+#ifdef TIMING_ENABLED
+	case 'D':
+		timing_report(&timing);
+		break;
+	case 'F':
+		timing_follow(&timing, true);
+		break;
+	case 'f':
+		timing_follow(&timing, false);
+		break;
+#endif
+	}
+}
+
+void report_init()
+{
+#ifdef MOUSE_ENABLED
+	mouse_init(&mouse);
+#endif
+}
+
+void report_poll()
+{
+	runlength_poll();
+	report_lines(&queue_report, report_queue_line, nullptr);
+	sched_report_poll();
+#ifdef MOUSE_ENABLED
+	mouse_poll(&mouse);
+#endif
+}
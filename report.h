@@ -0,0 +1,26 @@
+#ifndef REPORT_H
+#define REPORT_H
+
+#include <stdint.h>
+
+// text formatting of the capture log over CDC
+
+void print(char const *p);
+void print_hex(uint8_t c);
+void print_crlf();
+void print_dec(uint32_t v);
+bool print_ready();	// a whole line fits in the TX ring now
+
+// reports of several lines: `line` prints line i without the CR LF and
+// returns false after the last one. Prints one line per pass while
+// print_ready() holds, *next is the next line, 1 based, 0: none.
+void report_lines(uint8_t *next, bool (*line)(void *ctx, uint8_t i), void *ctx);
+
+void report_host_to_device(uint8_t c);
+void report_device_to_host(uint8_t c);
+void report_init();
+void report_poll();
+
+void command_poll();
+
+#endif
@@ -0,0 +1,162 @@
+#include "sched.h"
+#include "hal.h"
+#include "report.h"
+
+SchedStats sched_stats[SCHED_TASKS];
+SchedSleep sched_sleep_stats;
+
+static SchedTask const *sched_tasks;
+static volatile uint8_t sched_ready;	// bit n: task n posted
+static uint32_t ready_at[SCHED_TASKS];	// us, when posted
+static uint32_t last_at[SCHED_TASKS];	// us, start of the previous run
+static uint8_t sched_report_line;	// next report line, 1 based, 0: none
+static bool woken;	// no posted task ran since the last sleep
+
+static char const *const sched_names[SCHED_TASKS] = {
+	"relay ", "usb tx ", "usb rx ", "report ", "lcd ",
+};
+
+void sched_init(SchedTask const *tasks)
+{
+	sched_tasks = tasks;
+	sched_ready = 0;
+	uint32_t now = micros();
+	for (uint8_t i = 0; i < SCHED_TASKS; i++) {
+		last_at[i] = now;
+		sched_stats[i] = SchedStats();
+	}
+	sched_sleep_stats = SchedSleep();
+	woken = false;
+	sched_report_line = 0;
+}
+
+void sched_post(uint8_t task)
+{
+	uint8_t sreg = hal_irq_save();
+	uint8_t bit = 1 << task;
+	if (!(sched_ready & bit)) {
+		sched_ready |= bit;
+		ready_at[task] = micros();
+	}
+	hal_irq_restore(sreg);
+}
+
+static uint16_t clip(uint32_t us)
+{
+	return us > 0xffff ? 0xffff : us;
+}
+
+bool sched_poll()
+{
+	uint32_t now = micros();
+	uint8_t pick = SCHED_TASKS;
+	uint32_t late = 0;
+	uint32_t over = 0;	// of pick, beyond its deadline
+	uint8_t sreg = hal_irq_save();
+	for (uint8_t i = 0; i < SCHED_TASKS; i++) {
+		SchedTask const *t = &sched_tasks[i];
+		if (!t->run) continue;	// not built in
+		uint32_t since;
+		if (sched_ready & (1 << i)) {
+			since = ready_at[i];
+		} else if (t->period && now - last_at[i] >= t->period) {
+			since = last_at[i] + t->period;
+		} else {
+			continue;
+		}
+		uint32_t l = now - since;
+		uint32_t o = l > t->deadline ? l - t->deadline : 0;
+		if (pick == SCHED_TASKS || o > over) {
+			pick = i;
+			late = l;
+			over = o;
+		}
+	}
+	if (pick == SCHED_TASKS) {
+		hal_irq_restore(sreg);
+		return false;
+	}
+	uint8_t bit = 1 << pick;
+	bool posted = sched_ready & bit;
+	sched_ready &= ~bit;
+	hal_irq_restore(sreg);
+
+	SchedTask const *t = &sched_tasks[pick];
+	SchedStats *s = &sched_stats[pick];
+	uint16_t l = clip(late);
+	if (over) s->misses++;
+	if (l > s->late_max) s->late_max = l;
+	if (woken && posted) {	// the first task the wake-up posted
+		SchedSleep *z = &sched_sleep_stats;
+		if (l > SCHED_WAKE_DEADLINE) z->misses++;
+		if (l > z->wake_max) z->wake_max = l;
+	}
+	woken = false;
+	t->run();
+	uint32_t end = micros();
+	last_at[pick] = end;	// the period counts from the end of the run
+	uint16_t d = clip(end - now);
+	if (s->runs < 0xffff) {
+		s->runs++;
+		s->run_sum += d;
+	}
+	if (d > s->run_max) s->run_max = d;
+	return true;
+}
+
+void sched_sleep()
+{
+	uint32_t t = micros();
+	hal_irq_disable();
+	if (sched_ready) {	// posted since the last sched_poll()
+		hal_irq_enable();
+		return;
+	}
+	hal_sleep();
+	SchedSleep *z = &sched_sleep_stats;
+	if (z->sleeps < 0xffff) z->sleeps++;
+	z->slept += micros() - t;
+	woken = true;
+}
+
+void sched_report()
+{
+	sched_report_line = 1;
+}
+
+static bool sched_line(void *, uint8_t i)
+{
+	if (i == SCHED_TASKS) {
+		SchedSleep z = sched_sleep_stats;
+		sched_sleep_stats = SchedSleep();
+		print("L sleep ");
+		print_dec(z.sleeps);
+		print(" idle ");
+		print_dec(z.slept / 1000);
+		print(" wake ");
+		print_dec(z.wake_max);
+		print(" miss ");
+		print_dec(z.misses);
+		return false;
+	}
+	SchedStats s = sched_stats[i];
+	sched_stats[i] = SchedStats();
+	print("L ");
+	print(sched_names[i]);
+	print("runs ");
+	print_dec(s.runs);
+	print(" avg ");
+	print_dec(s.runs ? s.run_sum / s.runs : 0);
+	print(" max ");
+	print_dec(s.run_max);
+	print(" late ");
+	print_dec(s.late_max);
+	print(" miss ");
+	print_dec(s.misses);
+	return true;
+}
+
+void sched_report_poll()
+{
+	report_lines(&sched_report_line, sched_line, nullptr);
+}
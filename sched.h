@@ -0,0 +1,100 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdint.h>
+
+// cooperative scheduler of the main loop
+//
+// The tasks run to completion, one per sched_poll() call: the first of
+// the table that is ready, so the relay goes before everything else once
+// it is posted. A task becomes ready when an interrupt handler (or other
+// code) posts it with sched_post(), or when `period` us have passed since
+// the end of its last run; the period is the polling fallback for work
+// nobody posts. A task with more to do than one run posts itself.
+// From ready to the start of the run may take `deadline` us, a later
+// start is counted as a miss. Once a ready task is past its deadline,
+// the one furthest past it runs first, so a relay kept busy clocking
+// bytes out to the PC cannot starve the USB and the commands: they get
+// their runs in between. The 'L' command reports per task
+//
+//  L <task> runs <n> avg <us> max <us> late <us> miss <n>
+//
+// with the run time (avg, max), the longest wait from ready to run
+// (late) and the misses since the previous L.
+//
+// With nothing ready and nothing queued anywhere, the main loop calls
+// sched_sleep(): AVR idle sleep until an interrupt (PS/2 clocks, USB,
+// Timer0 every 128 us, Timer1). The interrupt handler itself runs 4
+// cycles later than from a busy loop. The wait from the post of that
+// handler to the start of its task is the wake latency; above
+// SCHED_WAKE_DEADLINE, the half bit time of the fastest PS/2 clock, it
+// counts as a miss. The last L line is
+//
+//  L sleep <n> idle <ms> wake <us> miss <n>
+//
+// with the sleeps, the time spent asleep, the longest wake latency and
+// its misses.
+
+#define SCHED_WAKE_DEADLINE 30	// us
+
+enum {
+	SCHED_RELAY,	// ps2_loop(), posted by the PS/2 clock and watchdog interrupts
+	SCHED_USB_TX,	// CDC IN ring to the endpoint, posted by the start of frame
+	SCHED_USB_RX,	// CDC OUT and the commands, posted by the start of frame
+	SCHED_REPORT,	// timed report stages, posted every ms
+	SCHED_LCD,	// one character to the LCD, posted by lcd_putchar()
+	SCHED_TASKS,
+};
+
+#ifdef __cplusplus
+
+struct SchedTask {
+	void (*run)();		// nullptr: the task is not built in
+	uint16_t period;	// us, 0: only when posted
+	uint16_t deadline;	// us from ready to run
+};
+
+// the table of the main loop, shared by main.cpp and the host stress run
+// so both schedule the same tasks; lcd is the LCD task or nullptr
+#define SCHED_MAIN_TASKS(lcd) { \
+	{ ps2_loop, 100, 200 },		/* SCHED_RELAY */ \
+	{ usb_poll_tx, 1000, 1000 },	/* SCHED_USB_TX */ \
+	{ command_poll, 1000, 2000 },	/* SCHED_USB_RX */ \
+	{ report_poll, 1000, 5000 },	/* SCHED_REPORT */ \
+	{ lcd, 0, 50000 },		/* SCHED_LCD */ \
+}
+
+struct SchedStats {
+	uint16_t runs;
+	uint16_t misses;
+	uint16_t run_max;	// us
+	uint16_t late_max;	// us
+	uint32_t run_sum;	// us
+};
+
+struct SchedSleep {
+	uint16_t sleeps;
+	uint16_t wake_max;	// us
+	uint16_t misses;
+	uint32_t slept;		// us
+};
+
+extern SchedStats sched_stats[SCHED_TASKS];
+extern SchedSleep sched_sleep_stats;
+
+void sched_init(SchedTask const *tasks);	// SCHED_TASKS entries, by priority
+bool sched_poll();	// false: nothing was ready
+void sched_sleep();	// unless a task was posted meanwhile
+void sched_report();
+void sched_report_poll();
+
+extern "C" {
+#endif
+
+void sched_post(uint8_t task);	// from interrupt handlers too
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,168 @@
+
+#include "shadow.h"
+#include "report.h"
+
+#ifdef SHADOW_ENABLED
+
+enum {
+	INFLIGHT_BUSY = 0x01,
+	INFLIGHT_LOCAL = 0x02,
+};
+
+#define SHADOW_MAX_RETRIES 3
+#define SHADOW_TIMEOUT 20	// ms
+#define SHADOW_FWD_MAX 16	// bytes, one bit each in fwd_local
+
+PS2Shadow ps2_shadow;
+
+static void reset_state(PS2Shadow *s)
+{
+	s->leds = 0;
+	s->typematic = 0x2b;	// 10.9 cps, 500 ms
+	s->scanset = 2;
+}
+
+void shadow_init(PS2Shadow *s)
+{
+	reset_state(s);
+	s->pending_cmd = 0;
+	queue_init(&s->fwd_queue, 1, SHADOW_FWD_MAX);
+	s->fwd_local = 0;
+	s->inflight_flags = 0;
+	s->errors = 0;
+}
+
+static void forward(PS2Shadow *s, uint8_t c, bool local)
+{
+	if (s->fwd_queue.len >= SHADOW_FWD_MAX) {
+		s->errors++;
+		return;
+	}
+	if (local) {
+		s->fwd_local |= 1u << s->fwd_queue.len;
+	}
+	queue_put(&s->fwd_queue, c);
+}
+
+// reply to the host ahead of anything already queued for it
+static void reply(PS2IF *host, uint8_t c)
+{
+	queue_unget(&host->output_queue, c);
+}
+
+void shadow_host_byte(PS2Shadow *s, PS2IF *host, uint8_t c)
+{
+	if (s->pending_cmd) {
+		uint8_t cmd = s->pending_cmd;
+		s->pending_cmd = 0;
+		if (c < 0x80) {	// argument
+			if (cmd == 0xf0 && c == 0) {	// get scan set
+				reply(host, s->scanset);
+				reply(host, 0xfa);
+				return;
+			}
+			switch (cmd) {
+			case 0xed: s->leds = c & 0x07; break;
+			case 0xf3: s->typematic = c; break;
+			case 0xf0: s->scanset = c; break;
+			}
+			reply(host, 0xfa);
+			forward(s, cmd, true);
+			forward(s, c, true);
+			return;
+		}
+		// a new command aborts the pending one
+	}
+
+	switch (c) {
+	case 0xed:	// set LEDs
+	case 0xf3:	// set typematic rate
+	case 0xf0:	// scan code set
+		reply(host, 0xfa);
+		s->pending_cmd = c;
+		return;
+	case 0xf6:	// set defaults
+	case 0xff:	// reset
+		reset_state(s);
+		break;
+	}
+	forward(s, c, false);
+}
+
+static void done(PS2Shadow *s)
+{
+	s->inflight_flags = 0;
+}
+
+static void retry(PS2Shadow *s, PS2IF *dev)
+{
+	if (s->retries < SHADOW_MAX_RETRIES) {
+		s->retries++;
+		s->timeout = SHADOW_TIMEOUT;
+		kb_put(dev, s->inflight);
+	} else {
+		// the host has its ACK already, tell whoever reads the log
+		print("S ");
+		print_hex(s->inflight);
+		print(" lost");
+		print_crlf();
+		s->errors++;
+		done(s);
+	}
+}
+
+// returns true if the byte was consumed and must not be relayed to the host
+bool shadow_device_byte(PS2Shadow *s, PS2IF *dev, uint8_t c)
+{
+	if (!(s->inflight_flags & INFLIGHT_BUSY)) return false;
+
+	bool local = s->inflight_flags & INFLIGHT_LOCAL;
+	switch (c) {
+	case 0xfa:	// ACK
+		done(s);
+		return local;
+	case 0xfe:	// RESEND
+		if (local) {
+			retry(s, dev);
+			return true;
+		}
+		done(s);	// the host resends by itself
+		return false;
+	case 0xee:	// echo
+		if (s->inflight == 0xee) {
+			done(s);
+		}
+		return false;
+	}
+	return false;
+}
+
+void shadow_poll(PS2Shadow *s, PS2IF *dev, bool timer_event_flag)
+{
+	if (s->inflight_flags & INFLIGHT_BUSY) {
+		if (timer_event_flag) {
+			if (s->timeout > 1) {
+				s->timeout--;
+			} else if (s->inflight_flags & INFLIGHT_LOCAL) {
+				retry(s, dev);
+			} else {
+				done(s);
+			}
+		}
+		return;
+	}
+
+	int c = queue_get(&s->fwd_queue);
+	if (c < 0) return;
+	s->inflight = c;
+	s->inflight_flags = INFLIGHT_BUSY;
+	if (s->fwd_local & 1) {
+		s->inflight_flags |= INFLIGHT_LOCAL;
+	}
+	s->fwd_local >>= 1;
+	s->retries = 0;
+	s->timeout = SHADOW_TIMEOUT;
+	kb_put(dev, c);
+}
+
+#endif // SHADOW_ENABLED
@@ -0,0 +1,44 @@
+#ifndef SHADOW_H
+#define SHADOW_H
+
+#include <stdint.h>
+#include "ps2if.h"
+
+//#define SHADOW_ENABLED
+
+#ifdef SHADOW_ENABLED
+
+// keyboard state shadow and local ACK emulation
+//
+// Well-known configuration commands from the host (set LEDs, typematic
+// rate, scan set) are acknowledged toward the host immediately and
+// forwarded to the keyboard in the background. The keyboard's own ACKs
+// for those bytes are swallowed, and RESENDs are retried locally.
+// A byte the keyboard still refuses after SHADOW_MAX_RETRIES is logged
+// as "S <byte> lost": the host believes it was taken, the keyboard
+// state no longer matches the shadow.
+
+struct PS2Shadow {
+	uint8_t leds;
+	uint8_t typematic;
+	uint8_t scanset;
+	uint8_t pending_cmd;	// command waiting for its argument byte
+	struct Queue fwd_queue;	// bytes waiting to be forwarded to the keyboard
+	uint16_t fwd_local;		// bit n: fwd_queue entry n was acknowledged locally
+	uint8_t inflight;		// byte sent to the keyboard, awaiting its response
+	uint8_t inflight_flags;
+	uint8_t retries;
+	uint8_t timeout;		// ms
+	uint8_t errors;
+};
+
+extern PS2Shadow ps2_shadow;
+
+void shadow_init(PS2Shadow *s);
+void shadow_host_byte(PS2Shadow *s, PS2IF *host, uint8_t c);
+bool shadow_device_byte(PS2Shadow *s, PS2IF *dev, uint8_t c);
+void shadow_poll(PS2Shadow *s, PS2IF *dev, bool timer_event_flag);
+
+#endif // SHADOW_ENABLED
+
+#endif // SHADOW_H
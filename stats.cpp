@@ -0,0 +1,48 @@
+#include "stats.h"
+#include "report.h"
+
+void stats_init(Stats *s, uint16_t base, uint8_t shift)
+{
+	s->base = base;
+	s->shift = shift;
+	stats_clear(s);
+}
+
+void stats_clear(Stats *s)
+{
+	s->n = 0;
+	s->min = 0xffff;
+	s->max = 0;
+	s->sum = 0;
+	for (uint8_t i = 0; i < STATS_BUCKETS; i++) {
+		s->hist[i] = 0;
+	}
+}
+
+void stats_add(Stats *s, uint16_t v)
+{
+	if (s->n == 0xffff) return;	// full, keep the mean consistent
+	s->n++;
+	s->sum += v;
+	if (v < s->min) s->min = v;
+	if (v > s->max) s->max = v;
+	uint16_t i = v < s->base ? 0 : (v - s->base) >> s->shift;
+	if (i >= STATS_BUCKETS) i = STATS_BUCKETS - 1;
+	s->hist[i]++;
+}
+
+void stats_print(Stats const *s)
+{
+	print_dec(s->n);
+	print(" ");
+	print_dec(s->n ? s->min : 0);
+	print(" ");
+	print_dec(s->n ? s->sum / s->n : 0);
+	print(" ");
+	print_dec(s->max);
+	print(" :");
+	for (uint8_t i = 0; i < STATS_BUCKETS; i++) {
+		print(" ");
+		print_dec(s->hist[i]);
+	}
+}
@@ -0,0 +1,32 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+// running distribution of a measured quantity
+//
+// Count, min, mean and max, plus a histogram of STATS_BUCKETS linear
+// buckets of 1 << shift starting at base; the first and the last bucket
+// also take what falls below or above. Cheap enough for an interrupt
+// handler. Printed as
+//
+//  <n> <min> <avg> <max> : <bucket 0> .. <bucket 7>
+
+#define STATS_BUCKETS 8
+
+struct Stats {
+	uint16_t n;
+	uint16_t min;
+	uint16_t max;
+	uint32_t sum;
+	uint16_t base;
+	uint8_t shift;
+	uint16_t hist[STATS_BUCKETS];
+};
+
+void stats_init(Stats *s, uint16_t base, uint8_t shift);
+void stats_clear(Stats *s);
+void stats_add(Stats *s, uint16_t v);
+void stats_print(Stats const *s);
+
+#endif // STATS_H
@@ -0,0 +1,135 @@
+#include "timing.h"
+
+#ifdef TIMING_ENABLED
+
+#include "hal.h"
+#include "ps2if.h"
+#include "report.h"
+
+Timing timing;
+
+static void timing_init_channel(TimingChannel *ch)
+{
+	ch->bits = 0;
+	ch->inhibit = 0;
+	ch->fall_us = micros() - TIMING_AGE;
+	stats_init(&ch->stats[TIMING_PERIOD], 800, 7);	// 8 us buckets from 50 us
+	stats_init(&ch->stats[TIMING_LOW], 320, 6);	// 4 us buckets from 20 us
+	stats_init(&ch->stats[TIMING_HIGH], 320, 6);
+	stats_init(&ch->stats[TIMING_FRAME], 600, 6);	// 64 us buckets from 600 us
+	stats_init(&ch->stats[TIMING_INHIBIT], 0, 13);	// 8 ms buckets
+	stats_init(&ch->stats[TIMING_RTS], 0, 6);	// 64 us buckets
+}
+
+void timing_init(Timing *t)
+{
+	timing_init_channel(&t->kb);
+	timing_init_channel(&t->pc);
+	t->follow = 0;
+	t->elapsed = 0;
+	t->report = 0;
+}
+
+void timing_edge(TimingChannel *ch, bool low, bool host_held, bool data)
+{
+	uint16_t now = hal_cycles();
+	uint32_t us = micros();
+	bool recent = us - ch->fall_us < TIMING_AGE;
+	if (low) {
+		if (host_held) {
+			ch->inhibit = 1;
+			ch->inhibit_at = us;
+			ch->bits = 0;
+			return;
+		}
+		uint16_t d = now - ch->fall_at;
+		if (ch->bits == 0 || ch->bits >= 11 || !recent || d > TIMING_GAP) {
+			ch->bits = 0;	// start bit, or a frame cut short
+			ch->start_at = now;
+		} else {
+			stats_add(&ch->stats[TIMING_PERIOD], d);
+			stats_add(&ch->stats[TIMING_HIGH], now - ch->rise_at);
+		}
+		ch->fall_at = now;
+		ch->fall_us = us;
+		if (++ch->bits == 11) {
+			stats_add(&ch->stats[TIMING_FRAME], (uint16_t)(now - ch->start_at) >> 4);
+		}
+		return;
+	}
+	if (ch->inhibit) {
+		ch->inhibit = 0;
+		uint32_t d = us - ch->inhibit_at;
+		stats_add(&ch->stats[data ? TIMING_INHIBIT : TIMING_RTS], d > 0xffff ? 0xffff : d);
+		return;
+	}
+	uint16_t d = now - ch->fall_at;
+	if (!recent || d > TIMING_PHASE_MAX) {
+		ch->bits = 0;	// the host side took over while the clock was low
+	} else if (ch->bits) {
+		stats_add(&ch->stats[TIMING_LOW], d);
+	}
+	ch->rise_at = now;
+}
+
+void timing_report(Timing *t)
+{
+	t->report = 1;
+}
+
+static char const *const timing_names[TIMING_STATS] = {
+	"period ", "low ", "high ", "frame ", "inhibit ", "rts ",
+};
+
+static bool timing_line(void *ctx, uint8_t i)
+{
+	Timing *t = (Timing *)ctx;
+	TimingChannel *ch = i < TIMING_STATS ? &t->kb : &t->pc;
+	Stats *s = &ch->stats[i % TIMING_STATS];
+
+	uint8_t sreg = hal_irq_save();
+	Stats copy = *s;
+	stats_clear(s);
+	hal_irq_restore(sreg);
+
+	print(i < TIMING_STATS ? "D kb " : "D pc ");
+	print(timing_names[i % TIMING_STATS]);
+	stats_print(&copy);
+	return i + 1 < 2 * TIMING_STATS;
+}
+
+// mean phase of the keyboard clock, in us within the legal range
+static uint8_t timing_phase(Stats *s, uint8_t fallback)
+{
+	uint8_t sreg = hal_irq_save();
+	uint16_t n = s->n;
+	uint32_t sum = s->sum;
+	hal_irq_restore(sreg);
+	if (n == 0) return fallback;
+	uint32_t us = sum / n / 16;
+	if (us < PS2_CLOCK_LOW_MIN) return PS2_CLOCK_LOW_MIN;
+	if (us > PS2_CLOCK_MAX) return PS2_CLOCK_MAX;
+	return us;
+}
+
+void timing_follow(Timing *t, bool follow)
+{
+	t->follow = follow;
+	t->elapsed = TIMING_FOLLOW;	// apply on the next tick
+	if (!follow) {
+		ps2h.clock_low = PS2_CLOCK_LOW;
+		ps2h.clock_high = PS2_CLOCK_HIGH;
+	}
+}
+
+void timing_poll(Timing *t, bool timer_event_flag)
+{
+	report_lines(&t->report, timing_line, t);
+	if (!t->follow || !timer_event_flag) return;
+	if (++t->elapsed < TIMING_FOLLOW) return;
+	t->elapsed = 0;
+	ps2h.clock_low = timing_phase(&t->kb.stats[TIMING_LOW], ps2h.clock_low);
+	ps2h.clock_high = timing_phase(&t->kb.stats[TIMING_HIGH], ps2h.clock_high);
+}
+
+#endif // TIMING_ENABLED
@@ -0,0 +1,77 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdint.h>
+#include "stats.h"
+
+//#define TIMING_ENABLED
+
+#ifdef TIMING_ENABLED
+
+// bus timing analyzer
+//
+// Both clock lines interrupt on every edge (INT0 keyboard, INT5 PC). Each
+// edge is timestamped with hal_cycles() and sorted into the statistics of
+// its channel: clocking by the device side (the keyboard, or pc_send() and
+// pc_recv() on the PC port) gives the bit timing, the clock held low by
+// the host side (the firmware toward the keyboard, the PC on its port)
+// an inhibit, or a request to send if data is low when it lets go. The
+// 'D' command reports and clears, one line per distribution:
+//
+//  D kb|pc period <stats>   falling to falling edge, CPU cycles (62.5 ns)
+//  D kb|pc low <stats>      clock low within a frame, cycles
+//  D kb|pc high <stats>     clock high within a frame, cycles
+//  D kb|pc frame <stats>    start bit to stop or ack bit, us
+//  D kb|pc inhibit <stats>  clock held by the host side, us
+//  D kb|pc rts <stats>      clock held before a request to send, us
+//
+// With 'F' the PC transmitter follows the keyboard: pc_send() takes the
+// mean low and high times measured on the keyboard, within the legal
+// 30..50 us, every TIMING_FOLLOW ms. 'f' goes back to the fixed clock.
+// About 350 bytes of RAM.
+
+#define TIMING_GAP (150 * 16)	// cycles between edges that ends a frame
+#define TIMING_PHASE_MAX (100 * 16)	// cycles, a legal clock phase is 30..50 us
+#define TIMING_AGE 1000	// us, a falling edge this old ended its frame, whatever the cycles say
+#define TIMING_FOLLOW 100	// ms
+
+enum {
+	TIMING_PERIOD,
+	TIMING_LOW,
+	TIMING_HIGH,
+	TIMING_FRAME,
+	TIMING_INHIBIT,
+	TIMING_RTS,
+	TIMING_STATS,
+};
+
+struct TimingChannel {
+	uint16_t fall_at;	// cycles
+	uint16_t rise_at;
+	uint16_t start_at;	// first falling edge of the frame
+	uint32_t fall_us;	// fall_at in us, the cycles wrap every 4.096 ms
+	uint32_t inhibit_at;	// us
+	uint8_t bits;		// falling edges so far in the frame
+	uint8_t inhibit;	// the host side holds the clock
+	Stats stats[TIMING_STATS];
+};
+
+struct Timing {
+	TimingChannel kb;
+	TimingChannel pc;
+	uint8_t follow;
+	uint8_t elapsed;	// ms since the last follow update
+	uint8_t report;		// next report line, 1 based, 0: none
+};
+
+extern Timing timing;
+
+void timing_init(Timing *t);
+void timing_edge(TimingChannel *ch, bool low, bool host_held, bool data);	// from the ISRs
+void timing_report(Timing *t);
+void timing_follow(Timing *t, bool follow);
+void timing_poll(Timing *t, bool timer_event_flag);
+
+#endif // TIMING_ENABLED
+
+#endif // TIMING_H
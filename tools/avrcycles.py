@@ -0,0 +1,356 @@
+#!/usr/bin/env python3
+# static cycle estimates of the firmware hot paths from avr-objdump output
+#
+#   avr-objdump -d -C ps2sniffer.elf | tools/avrcycles.py [-b baseline] [-w baseline]
+#
+# Every function is split into instructions with their control flow edges
+# and costed with the AVRe+ cycle table of the ATmega32U2 (16 bit PC).
+# min is the shortest path from entry to return with every loop run once,
+# max the longest path with every loop run LOOP_BOUNDS times. Calls add the
+# callee's cost; indirect calls (virtual PS2IO methods) are not followed
+# and are flagged. -b compares max against a baseline file and exits 1 on
+# any increase or without the file, -w writes the baseline.
+
+import re
+import sys
+
+REPORT = [
+	'countbits',
+	'queue_put',
+	'queue_get',
+	'intr',
+	'__vector_1',	# INT0, keyboard clock edge
+	'print_hex',
+	'usb_write_byte',
+]
+
+# iterations per loop, innermost first when a function has nested loops
+LOOP_BOUNDS = {
+	'countbits': [16],
+	'intr': [2],		# the deglitch majority samples
+	'__vector_1': [2],	# intr() inlined
+	'waitloop': [1],	# PS2_SAMPLE_SPACING, intr() is the only reported caller
+	'queue_put': [3],	# a block index times QUEUE_BLOCK (8) as a shift loop
+	'queue_get': [3],
+	'usb_poll_tx': [32, 2],
+	'usb_send_to_host': [32],
+	'usb_poll': [16, 32],
+	'usb_poll_rx': [16, 16],
+	'usb_data_rx': [16],
+}
+DEFAULT_BOUND = 1
+
+CYCLES = {
+	'adiw': 2, 'sbiw': 2,
+	'mul': 2, 'muls': 2, 'mulsu': 2, 'fmul': 2, 'fmuls': 2, 'fmulsu': 2,
+	'rjmp': 2, 'ijmp': 2, 'jmp': 3,
+	'rcall': 3, 'icall': 3, 'call': 4,
+	'ret': 4, 'reti': 4,
+	'ld': 2, 'ldd': 2, 'lds': 2, 'st': 2, 'std': 2, 'sts': 2,
+	'push': 2, 'pop': 2, 'sbi': 2, 'cbi': 2,
+	'lpm': 3, 'elpm': 3,
+}
+
+BRANCHES = {
+	'breq', 'brne', 'brcs', 'brcc', 'brsh', 'brlo', 'brmi', 'brpl',
+	'brge', 'brlt', 'brhs', 'brhc', 'brts', 'brtc', 'brvs', 'brvc',
+	'brie', 'brid', 'brbs', 'brbc',
+}
+SKIPS = {'cpse', 'sbrc', 'sbrs', 'sbic', 'sbis'}
+
+FUNC_RE = re.compile(r'^([0-9a-f]+) <(.+)>:$')
+INSN_RE = re.compile(r'^\s*([0-9a-f]+):\t((?:[0-9a-f]{2} )+)\s*\t(\S+)\s*(.*)$')
+TARGET_RE = re.compile(r';\s*0x([0-9a-f]+)')
+
+
+class Insn:
+	def __init__(self, addr, size, op, args):
+		self.addr = addr
+		self.size = size
+		self.op = op
+		self.args = args
+
+	def target(self):
+		m = TARGET_RE.search(self.args)
+		if m:
+			return int(m.group(1), 16)
+		m = re.match(r'0x([0-9a-f]+)', self.args)
+		return int(m.group(1), 16) if m else None
+
+	def cycles(self):
+		if self.op == 'ld' and '-' in self.args:
+			return 3
+		return CYCLES.get(self.op, 1)
+
+
+def parse(lines):
+	funcs = {}
+	name = None
+	for line in lines:
+		line = line.rstrip('\n')
+		m = FUNC_RE.match(line)
+		if m:
+			name = m.group(2)
+			funcs[name] = (int(m.group(1), 16), [])
+			continue
+		m = INSN_RE.match(line)
+		if m and name:
+			size = len(m.group(2).split())
+			funcs[name][1].append(Insn(int(m.group(1), 16), size, m.group(3), m.group(4)))
+	return funcs
+
+
+def short(name):
+	return name.split('(')[0]
+
+
+class Analyzer:
+	def __init__(self, funcs):
+		self.funcs = funcs
+		self.by_addr = {start: name for name, (start, _) in funcs.items()}
+		self.memo = {}
+
+	def callee(self, addr, notes):
+		name = self.by_addr.get(addr)
+		if name is None:
+			notes.add('unknown call 0x%x' % addr)
+			return (0, 0)
+		mn, mx, sub = self.cost(name)
+		notes.update(sub)
+		return (mn, mx)
+
+	def cost(self, name):
+		if name in self.memo:
+			return self.memo[name]
+		self.memo[name] = (0, 0, {'recursion'})
+		start, insns = self.funcs[name]
+		notes = set()
+		index = {i.addr: n for n, i in enumerate(insns)}
+
+		# edges: node -> [(next node or None for return, min cost, max cost)]
+		edges = []
+		for n, i in enumerate(insns):
+			c = i.cycles()
+			nxt = n + 1 if n + 1 < len(insns) else None
+			op = i.op
+			if op in ('ret', 'reti'):
+				edges.append([(None, c, c)])
+			elif op in BRANCHES:
+				t = index.get(i.target())
+				edges.append([(nxt, 1, 1), (t, 2, 2)])
+			elif op in SKIPS:
+				skip = n + 2 if n + 2 < len(insns) else None
+				s = 3 if nxt is not None and insns[nxt].size == 4 else 2
+				edges.append([(nxt, 1, 1), (skip, s, s)])
+			elif op in ('rjmp', 'jmp'):
+				t = i.target()
+				if t in index:
+					edges.append([(index[t], c, c)])
+				else:	# tail call
+					mn, mx = self.callee(t, notes)
+					edges.append([(None, c + mn, c + mx)])
+			elif op in ('rcall', 'call'):
+				mn, mx = self.callee(i.target(), notes)
+				edges.append([(nxt, c + mn, c + mx)])
+			elif op in ('icall', 'eicall'):
+				notes.add('indirect call')
+				edges.append([(nxt, c, c)])
+			elif op in ('ijmp', 'eijmp'):
+				notes.add('indirect jump')
+				edges.append([(None, c, c)])
+			else:
+				edges.append([(nxt, c, c)])
+
+		# back edges by depth first search from the entry
+		back = set()
+		state = {}
+		stack = [(0, iter(edges[0]))]
+		state[0] = 1
+		while stack:
+			n, it = stack[-1]
+			for t, _, _ in it:
+				if t is None:
+					continue
+				if state.get(t) == 1:
+					back.add((n, t))
+				elif t not in state:
+					state[t] = 1
+					stack.append((t, iter(edges[t])))
+					break
+			else:
+				state[n] = 2
+				stack.pop()
+
+		# topological order of the acyclic graph
+		order = []
+		seen = set()
+		def visit(n):
+			work = [(n, False)]
+			while work:
+				n, done = work.pop()
+				if done:
+					order.append(n)
+					continue
+				if n in seen:
+					continue
+				seen.add(n)
+				work.append((n, True))
+				for t, _, _ in edges[n]:
+					if t is not None and (n, t) not in back and t not in seen:
+						work.append((t, False))
+		visit(0)
+		order.reverse()
+
+		# natural loops, innermost first. The acyclic path may leave a loop at its
+		# header, so all bound iterations are charged there (one too many for
+		# loops entered at the bottom, which keeps max an upper bound).
+		extra = {}
+		loops = []
+		preds = {}
+		for n in order:
+			for t, _, _ in edges[n]:
+				if t is not None:
+					preds.setdefault(t, []).append(n)
+		for u, h in back:
+			body = {h, u}
+			work = [u]
+			while work:
+				n = work.pop()
+				if n == h:
+					continue
+				for p in preds.get(n, []):
+					if p not in body:
+						body.add(p)
+						work.append(p)
+			loops.append((len(body), insns[h].addr, u, h, body))
+		loops.sort()
+		bounds = LOOP_BOUNDS.get(short(name))
+		for k, (_, _, u, h, body) in enumerate(loops):
+			if bounds is None:
+				bound = DEFAULT_BOUND
+				notes.add('unbounded loop')
+			else:
+				bound = bounds[min(k, len(bounds) - 1)]
+			best = {h: extra.get(h, 0)}
+			for n in order:
+				if n not in best or n not in body:
+					continue
+				for t, _, mx in edges[n]:
+					if t is None or (n, t) in back or t not in body:
+						continue
+					v = best[n] + mx + extra.get(t, 0)
+					if v > best.get(t, -1):
+						best[t] = v
+			back_cost = max(mx for t, _, mx in edges[u] if t == h)
+			body_cost = best.get(u, 0) + back_cost
+			extra[h] = extra.get(h, 0) + bound * body_cost
+
+		# shortest and longest path from entry to a return
+		lo = {0: 0}
+		hi = {0: extra.get(0, 0)}
+		mn = None
+		mx = None
+		for n in order:
+			if n not in lo:
+				continue
+			for t, cmin, cmax in edges[n]:
+				if t is not None and (n, t) in back:
+					continue
+				a = lo[n] + cmin
+				b = hi[n] + cmax
+				if t is None:
+					mn = a if mn is None else min(mn, a)
+					mx = b if mx is None else max(mx, b)
+					continue
+				b += extra.get(t, 0)
+				if a < lo.get(t, a + 1):
+					lo[t] = a
+				if b > hi.get(t, -1):
+					hi[t] = b
+		if mn is None:
+			notes.add('no return')
+			mn = mx = 0
+		self.memo[name] = (mn, mx, notes)
+		return self.memo[name]
+
+
+def find(funcs, want):
+	for name in funcs:
+		if short(name) == want:
+			return name
+	return None
+
+
+def read_baseline(path):
+	base = {}
+	try:
+		with open(path) as f:
+			for line in f:
+				if line.startswith('#') or not line.strip():
+					continue
+				name, mn, mx = line.split()[:3]
+				base[name] = (int(mn), int(mx))
+	except FileNotFoundError:
+		return None
+	return base
+
+
+def main(argv):
+	baseline = None
+	write = None
+	args = argv[1:]
+	while args:
+		if args[0] == '-b' and len(args) > 1:
+			baseline = args[1]
+			args = args[2:]
+		elif args[0] == '-w' and len(args) > 1:
+			write = args[1]
+			args = args[2:]
+		else:
+			sys.stderr.write('usage: avr-objdump -d -C elf | %s [-b baseline] [-w baseline]\n' % argv[0])
+			return 2
+
+	funcs = parse(sys.stdin)
+	an = Analyzer(funcs)
+	results = []
+	for want in REPORT:
+		name = find(funcs, want)
+		if name is None:
+			results.append((want, None, None, 'not found (inlined?)'))
+			continue
+		mn, mx, notes = an.cost(name)
+		results.append((want, mn, mx, ', '.join(sorted(notes))))
+
+	base = read_baseline(baseline) if baseline else None
+	regressed = False
+	print('%-16s %7s %7s  %s' % ('function', 'min', 'max', 'notes'))
+	for want, mn, mx, notes in results:
+		if mn is None:
+			print('%-16s %7s %7s  %s' % (want, '-', '-', notes))
+			continue
+		delta = ''
+		if base and want in base:
+			d = mx - base[want][1]
+			if d:
+				delta = ' (%+d)' % d
+			if d > 0:
+				regressed = True
+		print('%-16s %7d %7d%s  %s' % (want, mn, mx, delta, notes))
+
+	if baseline and base is None and not write:
+		print('no baseline in %s, run make cycles-baseline' % baseline)
+		return 1
+	if write:
+		with open(write, 'w') as f:
+			f.write('# function min max (cycles), written by tools/avrcycles.py\n')
+			for want, mn, mx, _ in results:
+				if mn is not None:
+					f.write('%s %d %d\n' % (want, mn, mx))
+	if regressed:
+		print('max cycles increased over the baseline')
+		return 1
+	return 0
+
+
+if __name__ == '__main__':
+	sys.exit(main(sys.argv))
@@ -0,0 +1,43 @@
+#!/usr/bin/awk -f
+# checks that the pin writes of ps2if.cpp compile to single instructions
+#
+#   avr-objdump -d -C ps2if.o | awk -f tools/pinwrites.awk
+#
+# Every pc_/kb0_set_clock_0() ... set_data_1() must be one sbi or cbi on
+# PORTD and the ret, as promised by the GPIO types of avrgpio.h. Exits 1
+# and names the function otherwise, or if none was found.
+
+function finish()
+{
+	if (name ~ /_set_(clock|data)_[01](\(\))?$/) {
+		checked++
+		if (ops != " sbi ret" && ops != " cbi ret") {
+			print name ":" ops
+			bad++
+		}
+	}
+	name = ""
+	ops = ""
+}
+
+/^[0-9a-f]+ <.*>:$/ {
+	finish()
+	name = substr($0, index($0, "<") + 1)
+	sub(/>:$/, "", name)
+	next
+}
+
+/^ *[0-9a-f]+:\t/ {
+	split($0, f, "\t")
+	ops = ops " " f[3]
+}
+
+END {
+	finish()
+	if (checked == 0) {
+		print "no pin writes found"
+		exit 1
+	}
+	if (bad) exit 1
+	print checked " pin writes, one sbi/cbi each"
+}
@@ -0,0 +1,60 @@
+#include "translate.h"
+
+#ifdef TRANSLATE_ENABLED
+
+#include "hal.h"
+
+Translate translate;
+
+// set 2 code 00..7F to set 1, the first half of the 8042 table
+static const uint8_t set2_to_set1[128] PROGMEM = {
+	0xff, 0x43, 0x41, 0x3f, 0x3d, 0x3b, 0x3c, 0x58,
+	0x64, 0x44, 0x42, 0x40, 0x3e, 0x0f, 0x29, 0x59,
+	0x65, 0x38, 0x2a, 0x70, 0x1d, 0x10, 0x02, 0x5a,
+	0x66, 0x71, 0x2c, 0x1f, 0x1e, 0x11, 0x03, 0x5b,
+	0x67, 0x2e, 0x2d, 0x20, 0x12, 0x05, 0x04, 0x5c,
+	0x68, 0x39, 0x2f, 0x21, 0x14, 0x13, 0x06, 0x5d,
+	0x69, 0x31, 0x30, 0x23, 0x22, 0x15, 0x07, 0x5e,
+	0x6a, 0x72, 0x32, 0x24, 0x16, 0x08, 0x09, 0x5f,
+	0x6b, 0x33, 0x25, 0x17, 0x18, 0x0b, 0x0a, 0x60,
+	0x6c, 0x34, 0x35, 0x26, 0x27, 0x19, 0x0c, 0x61,
+	0x6d, 0x73, 0x28, 0x74, 0x1a, 0x0d, 0x62, 0x6e,
+	0x3a, 0x36, 0x1c, 0x1b, 0x75, 0x2b, 0x63, 0x76,
+	0x55, 0x56, 0x77, 0x78, 0x79, 0x7a, 0x0e, 0x7b,
+	0x7c, 0x4f, 0x7d, 0x4b, 0x47, 0x7e, 0x7f, 0x6f,
+	0x52, 0x53, 0x50, 0x4c, 0x4d, 0x48, 0x01, 0x45,
+	0x57, 0x4e, 0x51, 0x4a, 0x37, 0x49, 0x46, 0x54,
+};
+
+void translate_init(Translate *t)
+{
+	t->enabled = 0;
+	t->brk = 0;
+}
+
+void translate_enable(Translate *t, bool enabled)
+{
+	t->enabled = enabled;
+	t->brk = 0;
+}
+
+int translate_byte(Translate *t, uint8_t c)
+{
+	if (!t->enabled) return c;
+	if (c == 0xf0) {
+		t->brk = 0x80;
+		return -1;
+	}
+	uint8_t brk = t->brk;
+	t->brk = 0;
+	if (c < 0x80) {
+		c = pgm_read_byte(&set2_to_set1[c]);
+	} else if (c == 0x83) {	// F7
+		c = 0x41;
+	} else if (c == 0x84) {	// Alt+SysRq
+		c = 0x54;
+	}
+	return c | brk;
+}
+
+#endif // TRANSLATE_ENABLED
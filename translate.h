@@ -0,0 +1,30 @@
+#ifndef TRANSLATE_H
+#define TRANSLATE_H
+
+#include <stdint.h>
+
+//#define TRANSLATE_ENABLED
+
+#ifdef TRANSLATE_ENABLED
+
+// scan code set 2 to set 1 translation, as done by an 8042 controller
+//
+// Applied to the keyboard to PC relay for hosts that expect translated
+// codes. A table lookup per byte; F0 is swallowed and sets bit 7 of the
+// following code, E0/E1 and responses (>= 0x80) pass as they are. One
+// Translate per channel, off (pass-through) after translate_init().
+
+struct Translate {
+	uint8_t enabled;
+	uint8_t brk;	// F0 seen
+};
+
+extern Translate translate;
+
+void translate_init(Translate *t);
+void translate_enable(Translate *t, bool enabled);
+int translate_byte(Translate *t, uint8_t c);	// -1: nothing to send
+
+#endif // TRANSLATE_ENABLED
+
+#endif // TRANSLATE_H
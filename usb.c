@@ -3,9 +3,14 @@
 
 #define USB_SERIAL_PRIVATE_INCLUDE
 #include <avr/io.h>
+#include <stddef.h>
 #include "usb.h"
+#include "hal.h"
+#include "sched.h"
 
-void clear_buffers();
+#ifndef pgm_read_ptr
+#define pgm_read_ptr(p) ((void *)pgm_read_word(p))
+#endif
 
 /**************************************************************************
  *
@@ -171,7 +176,7 @@ PROGMEM const uint8_t config1_descriptor[] = {
 struct usb_string_descriptor_struct {
 	uint8_t bLength;
 	uint8_t bDescriptorType;
-	int16_t wString[];
+	wchar_t wString[];
 };
 static const struct usb_string_descriptor_struct PROGMEM string0 = {
 	4,
@@ -215,6 +220,7 @@ static struct descriptor_list_struct {
 
 static volatile uint8_t usb_configuration = 0;
 static volatile uint8_t data_flush_timer = 0;
+static volatile uint8_t tx_filling = 0; // IN bank being written, no flush on SOF
 static uint8_t idle_count = 0;
 
 /**************************************************************************
@@ -261,44 +267,51 @@ static void usb_flush_rx(uint8_t ep)
 	}
 }
 
+// The endpoint accesses below run with interrupts enabled: the USB
+// interrupts restore UENUM before they return, so the selection made here
+// survives them, and the SOF flush leaves a bank alone while it is filled.
+
 int8_t usb_send_to_host(uint8_t ep, uint8_t const *ptr, uint8_t len)
 {
 	int8_t r = -1;
 	if (!usb_configuration) return r;
-	uint8_t intr_state = SREG;
-	cli();
+	tx_filling = 1;
 	UENUM = ep;
-	uint8_t timeout = UDFNUML + 50;
-//	while (1) {
-		if (UEINTX & (1 << RWAL)) {
-			for (uint8_t i = 0; i < len; i++) {
-				UEDATX = ptr[i];
-			}
-			usb_release_tx();
-			idle_count = 0;
-			r = 0;
-//			break;
+	if (UEINTX & (1 << RWAL)) {
+		for (uint8_t i = 0; i < len; i++) {
+			UEDATX = ptr[i];
 		}
-//		if (UDFNUML == timeout) break;
-//	}
-done:;
-	SREG = intr_state;
+		usb_release_tx();
+		idle_count = 0;
+		r = 0;
+	}
+	tx_filling = 0;
 	return r;
 }
 
-void usb_data_tx(uint8_t const *ptr, uint8_t len)
+// number of bytes taken, 0 if both IN banks are still waiting for the host
+uint8_t usb_data_tx(uint8_t const *ptr, uint8_t len)
 {
 	if (ptr && len > 0) {
-		usb_send_to_host(DATA_IN_ENDPOINT, ptr, len);
+		if (usb_send_to_host(DATA_IN_ENDPOINT, ptr, len) == 0) {
+			return len;
+		}
 	}
+	return 0;
+}
+
+// true if the IN endpoint has a free bank, i.e. the host keeps up
+uint8_t usb_data_tx_ready()
+{
+	if (!usb_configuration) return 0;
+	UENUM = DATA_IN_ENDPOINT;
+	return UEINTX & (1 << RWAL);
 }
 
 uint8_t usb_data_rx(uint8_t *ptr, uint8_t len)
 {
 	const uint8_t ep = DATA_OUT_ENDPOINT;
 	uint8_t n = 0;
-	uint8_t intr_state = SREG;
-	cli();
 	UENUM = ep;
 	n = UEBCLX;
 	if (n > len) {
@@ -310,7 +323,6 @@ uint8_t usb_data_rx(uint8_t *ptr, uint8_t len)
 	if (n > 0 && UEBCLX == 0) {
 		usb_release_rx();
 	}
-	SREG = intr_state;
 	return n;
 }
 
@@ -318,12 +330,8 @@ uint8_t usb_read_available_()
 {
 	if (!usb_configuration) return 0;
 	const uint8_t ep = DATA_OUT_ENDPOINT;
-	uint8_t intr_state = SREG;
-	cli();
 	UENUM = ep;
-	uint8_t n = UEBCLX;
-	SREG = intr_state;
-	return n;
+	return UEBCLX;
 }
 
 uint8_t usb_read_byte_()
@@ -356,13 +364,29 @@ void usb_gen_vect()
 		usb_configuration = 0;
 	}
 
-	if (udint & (1 << SOFI)) {
+	if ((udint & (1 << SOFI)) && !tx_filling) {
 		usb_flush_rx(DATA_IN_ENDPOINT);
 	}
+	if (udint & (1 << SOFI)) {
+		sched_post(SCHED_USB_TX);
+		sched_post(SCHED_USB_RX);
+	}
 }
+// Both USB vectors mask their own source and run with interrupts enabled,
+// so a PS/2 clock edge waits for a few instructions only. They may
+// interrupt an endpoint access of the main loop and restore UENUM.
 ISR(USB_GEN_vect)
 {
+	PROFILE_ISR_ENTER();
+	uint8_t uenum = UENUM;
+	uint8_t udien = UDIEN;
+	UDIEN = 0;
+	hal_irq_enable();
 	usb_gen_vect();
+	hal_irq_disable();
+	UDIEN = udien;
+	UENUM = uenum;
+	PROFILE_ISR_EXIT(PROFILE_USB_GEN);
 }
 
 // Misc functions to wait for ready and send/receive packets
@@ -389,7 +413,7 @@ static inline void usb_ack_out()
 void usb_com_vect()
 {
 	uint8_t intbits;
-	const uint8_t *list;
+	const struct descriptor_list_struct *list;
 	uint8_t i, n, len;
 	uint8_t bmRequestType;
 	uint8_t bRequest;
@@ -413,27 +437,18 @@ void usb_com_vect()
 		wLength |= (UEDATX << 8);
 		UEINTX = ~((1 << RXSTPI) | (1 << RXOUTI) | (1 << TXINI));
 		if (bRequest == GET_DESCRIPTOR) {
-			list = (const uint8_t *)descriptor_list;
-			for (i = 0;; i++) {
+			list = descriptor_list;
+			for (i = 0;; i++, list++) {
 				if (i >= NUM_DESC_LIST) {
 					UECONX = (1 << STALLRQ) | (1 << EPEN); // stall
 					return;
 				}
-				desc_val = pgm_read_word(list);
-				if (desc_val != wValue) {
-					list += sizeof(struct descriptor_list_struct);
-					continue;
-				}
-				list += 2;
-				desc_val = pgm_read_word(list);
-				if (desc_val != wIndex) {
-					list += sizeof(struct descriptor_list_struct) - 2;
-					continue;
-				}
-				list += 2;
-				desc_addr = (const uint8_t *)pgm_read_word(list);
-				list += 2;
-				desc_length = pgm_read_byte(list);
+				desc_val = pgm_read_word(&list->wValue);
+				if (desc_val != wValue) continue;
+				desc_val = pgm_read_word(&list->wIndex);
+				if (desc_val != wIndex) continue;
+				desc_addr = (const uint8_t *)pgm_read_ptr(&list->addr);
+				desc_length = pgm_read_byte(&list->length);
 				break;
 			}
 			len = (wLength < 256) ? wLength : 255;
@@ -558,7 +573,8 @@ void usb_com_vect()
 					return;
 				}
 			}
-			if (bmRequestType == CDC_SET_CONTROL_LINE_STATE) {
+			if (bmRequestType == 0x21 && bRequest == CDC_SET_CONTROL_LINE_STATE) {
+				usb_send_in();
 				return;
 			}
 		}
@@ -567,5 +583,15 @@ void usb_com_vect()
 }
 ISR(USB_COM_vect)
 {
+	PROFILE_ISR_ENTER();
+	uint8_t uenum = UENUM;
+	UENUM = 0;
+	UEIENX = 0;
+	hal_irq_enable();
 	usb_com_vect();
+	hal_irq_disable();
+	UENUM = 0;
+	UEIENX = 1 << RXSTPE;
+	UENUM = uenum;
+	PROFILE_ISR_EXIT(PROFILE_USB_COM);
 }
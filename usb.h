@@ -2,7 +2,6 @@
 #define USB_H
 
 #include <stdint.h>
-#include <util/delay.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -11,8 +10,13 @@ extern "C" {
 void usb_init(void);
 uint8_t is_usb_configured(void);
 
-void usb_data_tx(const uint8_t *ptr, uint8_t len);
+uint8_t usb_data_tx(const uint8_t *ptr, uint8_t len);
+uint8_t usb_data_tx_ready(void);
 uint8_t usb_data_rx(uint8_t *ptr, uint8_t len);
+uint8_t usb_read_available_(void);
+uint8_t usb_read_byte_(void);
+
+void clear_buffers(void); // provided by the CDC layer
 
 #ifdef __cplusplus
 }
@@ -22,6 +26,8 @@ uint8_t usb_data_rx(uint8_t *ptr, uint8_t len);
 #define TX_EP_SIZE 32
 #define RX_EP_SIZE 32
 
+#ifdef USB_SERIAL_PRIVATE_INCLUDE
+#include <util/delay.h>
 #include <avr/interrupt.h>
 #include <avr/io.h>
 #include <avr/pgmspace.h>
@@ -90,5 +96,5 @@ uint8_t usb_data_rx(uint8_t *ptr, uint8_t len);
 #define CDC_SET_LINE_CODING 0x20
 #define CDC_GET_LINE_CODING 0x21
 #define CDC_SET_CONTROL_LINE_STATE 0x22
+#endif // USB_SERIAL_PRIVATE_INCLUDE
 #endif
-//#endif